@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cache.h"
+#include "utils.h"
+#include "rio.h"
+
+#define CACHE_MAX      (64 * 1024 * 1024)  /* bytes of bodies and heads kept in total */
+#define CACHE_BUCKETS  4096
+#define CACHE_HEURISTIC_MAX (24 * 60 * 60) /* cap on freshness guessed from Last-Modified */
+#define CACHE_SNAPSHOT 0x70637331u         /* "pcs1", first word of a cache_save stream */
+
+/* one per object in a cache_save stream, followed by its key, head and body */
+struct snapshot_rec {
+    uint32_t keylen;    // 0 ends the stream
+    uint32_t headlen;
+    uint32_t bodylen;
+    int64_t  expires;
+};
+
+static struct cache_obj *buckets[CACHE_BUCKETS];
+static struct cache_obj *lru_head;         // most recently used
+static struct cache_obj *lru_tail;
+static size_t            cache_size;
+static unsigned long     serials;
+static pthread_mutex_t   cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash(const char *key);
+static void     unlink_obj(struct cache_obj *obj);
+static void     free_obj(struct cache_obj *obj);
+static size_t   head_filter(const char *head, char *out);
+
+/*
+ * headers that describe one connection or one transfer, rather than the
+ * object itself, and are not stored (RFC 9110 7.6.1)
+ */
+static const char *hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+    "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-Length", NULL
+};
+
+int cache_storable(const char *head)
+{
+    char val[512];
+    int status = 0;
+
+    sscanf(head, "%*s %d", &status);
+    if (status != 200) return 0;
+
+    if (header_get(head, "Cache-Control", val, sizeof(val)) &&
+        (strcasestr(val, "no-store") || strcasestr(val, "private")))
+        return 0;
+
+    /* we key by URL alone, and may not hand one user's cookie to another */
+    if (header_get(head, "Set-Cookie", val, sizeof(val)))
+        return 0;
+
+    /*
+     * except on Accept-Encoding, where an unencoded body suits every client
+     * and the compressed variant is ours to make (see cache_answer in http.c)
+     */
+    if (header_get(head, "Vary", val, sizeof(val)) &&
+        (strcasecmp(val, "Accept-Encoding") || header_get(head, "Content-Encoding", val, sizeof(val))))
+        return 0;
+
+    if (header_get(head, "Content-Length", val, sizeof(val)) && atol(val) > CACHE_OBJMAX)
+        return 0;
+
+    return 1;
+}
+
+time_t cache_expiry(const char *head, time_t now)
+{
+    char val[512];
+    char *p;
+    time_t t, date;
+
+    if (header_get(head, "Cache-Control", val, sizeof(val))) {
+        if (strcasestr(val, "no-cache")) return now;  // store, but always revalidate
+        if ((p = strcasestr(val, "s-maxage=")) != NULL) return now + atol(p + 9);
+        if ((p = strcasestr(val, "max-age=")) != NULL) return now + atol(p + 8);
+    }
+
+    date = header_get(head, "Date", val, sizeof(val)) ? http_date(val) : -1;
+    if (date == -1) date = now;
+
+    if (header_get(head, "Expires", val, sizeof(val)))
+        return (t = http_date(val)) == -1 ? now : now + (t - date);
+
+    /* a tenth of the time since it last changed, RFC 9111 4.2.2 */
+    if (header_get(head, "Last-Modified", val, sizeof(val)) && (t = http_date(val)) != -1 && t < date) {
+        t = (date - t) / 10;
+        return now + (t > CACHE_HEURISTIC_MAX ? CACHE_HEURISTIC_MAX : t);
+    }
+
+    return now;
+}
+
+struct cache_obj *cache_lookup(const char *key)
+{
+    struct cache_obj *obj;
+
+    pthread_mutex_lock(&cache_mutex);
+    for (obj = buckets[hash(key) % CACHE_BUCKETS]; obj != NULL; obj = obj->hnext) {
+        if (!strcmp(obj->key, key)) break;
+    }
+
+    if (obj != NULL) {
+        obj->refcnt++;
+
+        /* move to the front of the LRU list */
+        if (obj != lru_head) {
+            obj->lru_prev->lru_next = obj->lru_next;
+            if (obj->lru_next != NULL) obj->lru_next->lru_prev = obj->lru_prev;
+            else lru_tail = obj->lru_prev;
+            obj->lru_prev = NULL;
+            obj->lru_next = lru_head;
+            lru_head->lru_prev = obj;
+            lru_head = obj;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    return obj;
+}
+
+void cache_release(struct cache_obj *obj)
+{
+    int last;
+
+    if (obj == NULL) return;
+
+    pthread_mutex_lock(&cache_mutex);
+    last = --obj->refcnt == 0 && !obj->linked;
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (last) free_obj(obj);
+}
+
+struct cache_obj *cache_insert(const char *key, const char *head, char *body, size_t bodylen)
+{
+    struct cache_obj *obj, *old;
+    char filtered[8192];
+    size_t headlen;
+    uint32_t b;
+
+    if (strlen(head) >= sizeof(filtered) || bodylen > CACHE_OBJMAX) {
+        free(body);
+        return NULL;
+    }
+    headlen = head_filter(head, filtered);
+
+    obj = (struct cache_obj *) calloc(1, sizeof(struct cache_obj));
+    obj->key     = strdup(key);
+    obj->head    = strdup(filtered);
+    obj->headlen = headlen;
+    obj->body    = body;
+    obj->bodylen = bodylen;
+    obj->expires = cache_expiry(head, time(NULL));
+    header_get(head, "ETag", obj->etag, sizeof(obj->etag));
+    header_get(head, "Last-Modified", obj->last_modified, sizeof(obj->last_modified));
+    obj->refcnt  = 1;   // the caller's
+    obj->linked  = 1;
+
+    b = hash(key) % CACHE_BUCKETS;
+
+    pthread_mutex_lock(&cache_mutex);
+    obj->serial = ++serials;
+    for (old = buckets[b]; old != NULL; old = old->hnext) {
+        if (!strcmp(old->key, key)) break;
+    }
+    if (old != NULL) {
+        unlink_obj(old);
+        if (old->refcnt == 0) free_obj(old);
+    }
+
+    /* make room, least recently used first */
+    while (lru_tail != NULL && cache_size + bodylen + headlen > CACHE_MAX) {
+        old = lru_tail;
+        unlink_obj(old);
+        if (old->refcnt == 0) free_obj(old);
+    }
+
+    obj->hnext = buckets[b];
+    buckets[b] = obj;
+    obj->lru_next = lru_head;
+    if (lru_head != NULL) lru_head->lru_prev = obj;
+    lru_head = obj;
+    if (lru_tail == NULL) lru_tail = obj;
+    cache_size += bodylen + headlen;
+    pthread_mutex_unlock(&cache_mutex);
+
+    return obj;
+}
+
+int cache_fresh(struct cache_obj *obj)
+{
+    int fresh;
+
+    pthread_mutex_lock(&cache_mutex);
+    fresh = obj->expires > time(NULL);
+    pthread_mutex_unlock(&cache_mutex);
+
+    return fresh;
+}
+
+void cache_refresh(struct cache_obj *obj, const char *head)
+{
+    char val[512];
+    time_t now = time(NULL);
+    time_t expires;
+
+    /* the 304 may carry new freshness information, otherwise start over with the stored one */
+    if (header_get(head, "Cache-Control", val, sizeof(val)) || header_get(head, "Expires", val, sizeof(val)))
+        expires = cache_expiry(head, now);
+    else
+        expires = cache_expiry(obj->head, now);
+
+    pthread_mutex_lock(&cache_mutex);
+    obj->expires = expires;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+int cache_save(int fd)
+{
+    struct cache_obj **objs, *obj;
+    struct snapshot_rec rec;
+    uint32_t magic = CACHE_SNAPSHOT;
+    int cnt = 0, i, failed = 0;
+
+    /* take references, so the writing happens without the lock held */
+    pthread_mutex_lock(&cache_mutex);
+    for (obj = lru_tail; obj != NULL; obj = obj->lru_prev) cnt++;
+    objs = (struct cache_obj **) malloc(sizeof(*objs) * (cnt + 1));
+    cnt = 0;
+    for (obj = lru_tail; obj != NULL; obj = obj->lru_prev) {
+        if (obj->derived) continue;  // cheaper to make again than to check against its original
+        obj->refcnt++;
+        objs[cnt++] = obj;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (rio_writen(fd, &magic, sizeof(magic)) == -1) failed = 1;
+
+    for (i = 0; i < cnt; ++i) {
+        obj = objs[i];
+        if (!failed) {
+            memset(&rec, 0, sizeof(rec));
+            rec.keylen  = (uint32_t) strlen(obj->key);
+            rec.headlen = (uint32_t) obj->headlen;
+            rec.bodylen = (uint32_t) obj->bodylen;
+            pthread_mutex_lock(&cache_mutex);
+            rec.expires = (int64_t) obj->expires;
+            pthread_mutex_unlock(&cache_mutex);
+
+            if (rio_writen(fd, &rec, sizeof(rec)) == -1 ||
+                rio_writen(fd, obj->key, rec.keylen) == -1 ||
+                rio_writen(fd, obj->head, rec.headlen) == -1 ||
+                (rec.bodylen > 0 && rio_writen(fd, obj->body, rec.bodylen) == -1))
+                failed = 1;
+        }
+        cache_release(obj);
+    }
+    free(objs);
+
+    memset(&rec, 0, sizeof(rec));
+    if (failed || rio_writen(fd, &rec, sizeof(rec)) == -1) return -1;
+    return cnt;
+}
+
+int cache_load(int fd)
+{
+    struct cache_obj *obj;
+    struct snapshot_rec rec;
+    uint32_t magic;
+    char *key, *head, *body;
+    int cnt = 0;
+
+    if (rio_readn(fd, &magic, sizeof(magic)) != sizeof(magic) || magic != CACHE_SNAPSHOT)
+        return -1;
+
+    for (;;) {
+        if (rio_readn(fd, &rec, sizeof(rec)) != sizeof(rec)) return -1;
+        if (rec.keylen == 0) break;
+        if (rec.headlen >= 8192 || rec.bodylen > CACHE_OBJMAX) return -1;
+
+        key  = (char *) malloc(rec.keylen + 1);
+        head = (char *) malloc(rec.headlen + 1);
+        body = (char *) malloc(rec.bodylen > 0 ? rec.bodylen : 1);
+        if (rio_readn(fd, key, rec.keylen) != rec.keylen ||
+            rio_readn(fd, head, rec.headlen) != rec.headlen ||
+            (rec.bodylen > 0 && rio_readn(fd, body, rec.bodylen) != rec.bodylen)) {
+            free(key);
+            free(head);
+            free(body);
+            return -1;
+        }
+        key[rec.keylen] = '\0';
+        head[rec.headlen] = '\0';
+
+        /* least recently used come first, so the LRU order carries over */
+        if ((obj = cache_insert(key, head, body, rec.bodylen)) != NULL) {
+            pthread_mutex_lock(&cache_mutex);
+            obj->expires = (time_t) rec.expires;  // may have been refreshed since it was stored
+            pthread_mutex_unlock(&cache_mutex);
+            cache_release(obj);
+            cnt++;
+        }
+        free(key);
+        free(head);
+    }
+
+    return cnt;
+}
+
+/*
+ * Static functions
+ */
+
+static uint32_t hash(const char *key)
+/* FNV-1a */
+{
+    uint32_t h = 2166136261u;
+
+    while (*key) {
+        h ^= (unsigned char) *key++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void unlink_obj(struct cache_obj *obj)
+/* take obj out of the table and the LRU list, with cache_mutex held */
+{
+    struct cache_obj **pp = &buckets[hash(obj->key) % CACHE_BUCKETS];
+
+    while (*pp != obj) pp = &(*pp)->hnext;
+    *pp = obj->hnext;
+
+    if (obj->lru_prev != NULL) obj->lru_prev->lru_next = obj->lru_next;
+    else lru_head = obj->lru_next;
+    if (obj->lru_next != NULL) obj->lru_next->lru_prev = obj->lru_prev;
+    else lru_tail = obj->lru_prev;
+
+    cache_size -= obj->bodylen + obj->headlen;
+    obj->linked = 0;
+}
+
+static void free_obj(struct cache_obj *obj)
+{
+    free(obj->key);
+    free(obj->head);
+    free(obj->body);
+    free(obj);
+}
+
+static size_t head_filter(const char *head, char *out)
+/* copy head to out without hop-by-hop headers and the blank line ending it */
+{
+    const char *line = head, *end;
+    size_t n = 0;
+    int keep, i;
+
+    while (*line != '\0' && strncmp(line, "\r\n", 2)) {
+        end = strchr(line, '\n');
+        end = end != NULL ? end + 1 : line + strlen(line);
+
+        keep = 1;
+        for (i = 0; line != head && hop_headers[i] != NULL; ++i) {
+            size_t len = strlen(hop_headers[i]);
+            if (!strncasecmp(line, hop_headers[i], len) && line[len] == ':') {
+                keep = 0;
+                break;
+            }
+        }
+
+        if (keep) {
+            memcpy(out + n, line, end - line);
+            n += end - line;
+        }
+        line = end;
+    }
+
+    out[n] = '\0';
+    return n;
+}
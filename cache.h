@@ -0,0 +1,67 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <time.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define CACHE_OBJMAX (1024 * 1024)  /* larger responses are not stored */
+
+/*
+ * An in-memory cache of complete GET responses, keyed by absolute URL
+ * and bounded by an LRU policy. Objects are reference counted, so one
+ * may be replaced or evicted while another thread is still sending it.
+ */
+
+struct cache_obj {
+    char   *key;
+    char   *head;          // status line and end-to-end headers, CRLF-terminated
+    size_t  headlen;
+    char   *body;
+    size_t  bodylen;
+    char    etag[256];     // validators, empty if the origin sent none
+    char    last_modified[64];
+    time_t  expires;       // fresh until, see cache_fresh and cache_refresh
+
+    atomic_int prefetched; // stored by a prefetch and not asked for since
+    unsigned long serial;  // set by cache_insert, tells versions of a key apart
+    unsigned long derived; // serial of the object this one was made from, 0 if none
+
+    int     refcnt;
+    int     linked;        // still reachable through the table
+    struct cache_obj *hnext;
+    struct cache_obj *lru_prev, *lru_next;
+};
+
+// can a response with this head (status line and headers) be stored?
+int    cache_storable(const char *head);
+
+// when a response with this head, received at now, stops being fresh
+time_t cache_expiry(const char *head, time_t now);
+
+// the object stored for key with a reference held, or NULL
+struct cache_obj *cache_lookup(const char *key);
+
+// give back a reference from cache_lookup or cache_insert
+void   cache_release(struct cache_obj *obj);
+
+// store a response, replacing whatever was stored for key; body is
+// taken over and freed by the cache. Returns the object with a
+// reference held, or NULL (body is freed then too)
+struct cache_obj *cache_insert(const char *key, const char *head, char *body, size_t bodylen);
+
+// nonzero while obj may be served without asking the origin
+int    cache_fresh(struct cache_obj *obj);
+
+// the origin answered a revalidation of obj with a 304 carrying head
+void   cache_refresh(struct cache_obj *obj, const char *head);
+
+// write every object to fd, least recently used first, for cache_load in
+// another process; the number written, or -1 if fd failed
+int    cache_save(int fd);
+
+// store the objects cache_save wrote to fd; the number read, or -1 if
+// fd failed or did not carry a snapshot
+int    cache_load(int fd);
+
+#endif
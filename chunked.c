@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include "chunked.h"
+
+enum {
+    CH_SIZE,        // hex digits of the chunk size
+    CH_EXT,         // chunk extensions, ignored
+    CH_SIZE_LF,     // end of the size line
+    CH_DATA,
+    CH_DATA_CR,     // CRLF after the chunk data
+    CH_DATA_LF,
+    CH_TRAILER,     // start of a trailer line, or of the final CRLF
+    CH_TRAILER_LINE,
+    CH_FINAL_LF,
+};
+
+static int hexval(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void chunked_init(struct chunked *cp)
+{
+    cp->state = CH_SIZE;
+    cp->left  = 0;
+    cp->done  = 0;
+}
+
+ssize_t chunked_decode(struct chunked *cp, const char *buf, size_t len,
+                       chunk_data_t data, void *ctx)
+{
+    size_t i = 0;
+
+    while (i < len && !cp->done) {
+        char c = buf[i];
+
+        switch (cp->state) {
+        case CH_SIZE:
+            if (hexval(c) >= 0) {
+                if (cp->left > (UINT64_MAX >> 4)) return -1;  // absurd size
+                cp->left = (cp->left << 4) | hexval(c);
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                cp->state = CH_EXT;
+            } else if (c == '\r') {
+                cp->state = CH_SIZE_LF;
+            } else if (c == '\n') {
+                cp->state = cp->left ? CH_DATA : CH_TRAILER;
+            } else {
+                return -1;
+            }
+            i++;
+            break;
+
+        case CH_EXT:
+            if (c == '\n') cp->state = cp->left ? CH_DATA : CH_TRAILER;
+            else if (c == '\r') cp->state = CH_SIZE_LF;
+            i++;
+            break;
+
+        case CH_SIZE_LF:
+            if (c != '\n') return -1;
+            cp->state = cp->left ? CH_DATA : CH_TRAILER;
+            i++;
+            break;
+
+        case CH_DATA: {
+            size_t n = len - i < cp->left ? len - i : (size_t) cp->left;
+            if (data != NULL && data(ctx, buf + i, n) == -1) return -1;
+            cp->left -= n;
+            i += n;
+            if (cp->left == 0) cp->state = CH_DATA_CR;
+            break;
+        }
+
+        case CH_DATA_CR:
+            if (c == '\r') cp->state = CH_DATA_LF;
+            else if (c == '\n') cp->state = CH_SIZE;
+            else return -1;
+            i++;
+            break;
+
+        case CH_DATA_LF:
+            if (c != '\n') return -1;
+            cp->state = CH_SIZE;
+            i++;
+            break;
+
+        case CH_TRAILER:
+            if (c == '\r') cp->state = CH_FINAL_LF;
+            else if (c == '\n') cp->done = 1;
+            else cp->state = CH_TRAILER_LINE;
+            i++;
+            break;
+
+        case CH_TRAILER_LINE:
+            if (c == '\n') cp->state = CH_TRAILER;
+            i++;
+            break;
+
+        case CH_FINAL_LF:
+            if (c != '\n') return -1;
+            cp->done = 1;
+            i++;
+            break;
+        }
+    }
+
+    return i;
+}
+
+size_t chunked_header(char *dst, size_t n)
+{
+    return (size_t) snprintf(dst, CHUNK_HDRMAX, "%zx\r\n", n);
+}
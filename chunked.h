@@ -0,0 +1,39 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * An incremental parser for the chunked transfer coding
+ * (RFC 9112, section 7.1). It never buffers: feed it whatever has
+ * arrived and it tells how much of that belongs to the message and
+ * hands out the chunk data it found.
+ */
+
+struct chunked {
+    int      state;
+    uint64_t left;      // chunk data bytes still to come in the current chunk
+    int      done;      // last chunk and trailer section seen
+};
+
+// called with each run of decoded chunk data, returns -1 to abort
+typedef int (*chunk_data_t)(void *ctx, const char *data, size_t n);
+
+void    chunked_init(struct chunked *cp);
+
+// parse up to len bytes of chunked input. Returns how many of them are
+// part of the message, which is fewer than len only once cp->done is set,
+// or -1 for malformed input or when data returns -1. data may be NULL.
+ssize_t chunked_decode(struct chunked *cp, const char *buf, size_t len,
+                       chunk_data_t data, void *ctx);
+
+// write the line that starts a chunk of n bytes into dst, which must
+// hold CHUNK_HDRMAX bytes, and return its length
+size_t  chunked_header(char *dst, size_t n);
+
+#define CHUNK_HDRMAX 20
+#define CHUNK_CRLF   "\r\n"
+#define CHUNK_LAST   "0\r\n\r\n"
+
+#endif
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <ucontext.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "coro.h"
+
+#define CORO_STACK    (256 * 1024)  /* usable stack of a coroutine, proxy_connect keeps ~64K of buffers on it */
+#define CORO_POOLED   256           /* idle stacks a scheduler keeps around for reuse */
+#define CORO_MAXEVENT 256
+
+/*
+ * Every scheduler owns an epoll instance. A coroutine that has to wait
+ * registers its fds there with EPOLLONESHOT and switches back to the
+ * scheduler, which resumes it once epoll reports one of them (or its
+ * timeout passes). New coroutines arrive through a locked inbox and an
+ * eventfd that wakes the scheduler up.
+ *
+ * Context switches use ucontext, which costs a sigprocmask syscall per
+ * switch; that is small next to the I/O each switch waits for.
+ */
+
+enum coro_state { CORO_READY, CORO_WAITING, CORO_DONE };
+
+struct coro {
+    ucontext_t        ctx;
+    char             *stack;          // lowest address, which is the guard page
+    thr_func_t        func;
+    void             *arg;
+    enum coro_state   state;
+    long              deadline;       // ms, -1 when waiting without a timeout
+    struct coro      *next;           // run queue or inbox
+    struct coro      *tnext, *tprev;  // list of waiters with a deadline
+};
+
+struct coro_sched {
+    int              epfd;
+    int              evfd;            // signalled when the inbox fills
+    pthread_mutex_t  inbox_mutex;
+    struct coro     *inbox;
+    atomic_int       live;            // coroutines owned by this scheduler
+    struct coro     *runq_head;
+    struct coro     *runq_tail;
+    struct coro     *timed;
+    char            *stacks[CORO_POOLED];
+    int              nstacks;
+    ucontext_t       ctx;             // where coroutines switch back to
+};
+
+static struct coro_sched *scheds;
+static int                sched_cnt;
+static long               pagesize;
+
+static __thread struct coro_sched *cur_sched;
+static __thread struct coro       *cur_coro;
+
+static void  coro_sched_run(void *arg);
+static void  coro_main(void);
+static int   coro_init(struct coro_sched *sched, struct coro *co);
+static void  coro_free(struct coro_sched *sched, struct coro *co);
+static void  coro_wake(struct coro_sched *sched, struct coro *co);
+static void  runq_push(struct coro_sched *sched, struct coro *co);
+static long  now_ms();
+
+int coro_start(tpool_t *tpool, int num)
+{
+    struct epoll_event ev;
+
+    if (tpool == NULL || num <= 0 || scheds != NULL) return -1;
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    scheds = (struct coro_sched *) calloc(num, sizeof(struct coro_sched));
+    if (scheds == NULL) return -1;
+
+    for (int i = 0; i < num; ++i) {
+        struct coro_sched *sched = &scheds[i];
+
+        sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+        sched->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (sched->epfd == -1 || sched->evfd == -1) {
+            perror("coro_start");
+            return -1;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;  // the only entry that is not a coroutine
+        epoll_ctl(sched->epfd, EPOLL_CTL_ADD, sched->evfd, &ev);
+
+        pthread_mutex_init(&(sched->inbox_mutex), NULL);
+        atomic_init(&sched->live, 0);
+    }
+    sched_cnt = num;
+
+    for (int i = 0; i < num; ++i)
+        tpool_add_job(tpool, coro_sched_run, &scheds[i]);
+
+    return 0;
+}
+
+int coro_spawn(thr_func_t func, void *arg)
+{
+    struct coro_sched *sched;
+    struct coro *co;
+    uint64_t one = 1;
+
+    if (sched_cnt == 0 || func == NULL) return -1;
+
+    co = (struct coro *) calloc(1, sizeof(struct coro));
+    if (co == NULL) return -1;
+    co->func = func;
+    co->arg  = arg;
+
+    /* the stack is set up by the scheduler, so it is first touched on its node */
+    sched = &scheds[0];
+    for (int i = 1; i < sched_cnt; ++i) {
+        if (atomic_load(&scheds[i].live) < atomic_load(&sched->live))
+            sched = &scheds[i];
+    }
+    atomic_fetch_add(&sched->live, 1);
+
+    pthread_mutex_lock(&(sched->inbox_mutex));
+    co->next = sched->inbox;
+    sched->inbox = co;
+    pthread_mutex_unlock(&(sched->inbox_mutex));
+
+    if (write(sched->evfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("coro_spawn");
+
+    return 0;
+}
+
+int coro_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    struct coro *co = cur_coro;
+    struct coro_sched *sched = cur_sched;
+    struct epoll_event ev;
+    nfds_t i;
+
+    if (co == NULL || timeout == 0)
+        return poll(fds, nfds, timeout);
+
+    for (i = 0; i < nfds; ++i) {
+        ev.events = EPOLLONESHOT;
+        if (fds[i].events & POLLIN)  ev.events |= EPOLLIN;
+        if (fds[i].events & POLLOUT) ev.events |= EPOLLOUT;
+        ev.data.ptr = co;
+
+        if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) == -1) {
+            /* not something epoll can watch, block the old way */
+            while (i-- > 0)
+                epoll_ctl(sched->epfd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+            return poll(fds, nfds, timeout);
+        }
+    }
+
+    co->state = CORO_WAITING;
+    co->deadline = -1;
+    if (timeout > 0) {
+        co->deadline = now_ms() + timeout;
+        co->tprev = NULL;
+        co->tnext = sched->timed;
+        if (sched->timed != NULL) sched->timed->tprev = co;
+        sched->timed = co;
+    }
+
+    swapcontext(&co->ctx, &sched->ctx);
+
+    for (i = 0; i < nfds; ++i)
+        epoll_ctl(sched->epfd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+
+    /* epoll only told us which coroutine to wake, let poll fill in revents */
+    return poll(fds, nfds, 0);
+}
+
+int coro_active(void)
+{
+    return cur_coro != NULL;
+}
+
+/*
+ * Static functions
+ */
+
+static void coro_sched_run(void *arg)
+/* the job each scheduler runs on its worker, it never returns */
+{
+    struct coro_sched *sched = arg;
+    struct epoll_event events[CORO_MAXEVENT];
+    struct coro *co, *next;
+    uint64_t cnt;
+    long now;
+    int timeout, n;
+
+    cur_sched = sched;
+
+    for (;;) {
+        pthread_mutex_lock(&(sched->inbox_mutex));
+        co = sched->inbox;
+        sched->inbox = NULL;
+        pthread_mutex_unlock(&(sched->inbox_mutex));
+
+        for (; co != NULL; co = next) {
+            next = co->next;
+            if (coro_init(sched, co) == -1) {
+                /* out of memory for stacks, run it here rather than drop it */
+                co->func(co->arg);
+                free(co);
+                atomic_fetch_sub(&sched->live, 1);
+                continue;
+            }
+            runq_push(sched, co);
+        }
+
+        while ((co = sched->runq_head) != NULL) {
+            sched->runq_head = co->next;
+            if (sched->runq_head == NULL) sched->runq_tail = NULL;
+
+            cur_coro = co;
+            swapcontext(&sched->ctx, &co->ctx);
+            cur_coro = NULL;
+
+            if (co->state == CORO_DONE)
+                coro_free(sched, co);
+        }
+
+        timeout = -1;
+        now = now_ms();
+        for (co = sched->timed; co != NULL; co = co->tnext) {
+            long left = co->deadline > now ? co->deadline - now : 0;
+            if (timeout == -1 || left < timeout) timeout = (int) left;
+        }
+
+        n = epoll_wait(sched->epfd, events, CORO_MAXEVENT, timeout);
+        if (n == -1 && errno != EINTR) perror("coro epoll_wait");
+
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == NULL) {
+                if (read(sched->evfd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+                    perror("coro eventfd");
+                continue;
+            }
+            coro_wake(sched, events[i].data.ptr);
+        }
+
+        now = now_ms();
+        for (co = sched->timed; co != NULL; co = next) {
+            next = co->tnext;
+            if (co->deadline <= now) coro_wake(sched, co);
+        }
+    }
+}
+
+static void coro_main(void)
+/* first frame of every coroutine, returning resumes uc_link (the scheduler) */
+{
+    struct coro *co = cur_coro;
+
+    co->func(co->arg);
+    co->state = CORO_DONE;
+}
+
+static int coro_init(struct coro_sched *sched, struct coro *co)
+{
+    size_t size = CORO_STACK + pagesize;
+
+    if (sched->nstacks > 0) {
+        co->stack = sched->stacks[--sched->nstacks];
+    } else {
+        co->stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (co->stack == MAP_FAILED) {
+            co->stack = NULL;
+            return -1;
+        }
+        /* an overflow faults on the guard page instead of corrupting a neighbour */
+        mprotect(co->stack, pagesize, PROT_NONE);
+    }
+
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack + pagesize;
+    co->ctx.uc_stack.ss_size = CORO_STACK;
+    co->ctx.uc_link = &sched->ctx;
+    makecontext(&co->ctx, coro_main, 0);
+    co->state = CORO_READY;
+
+    return 0;
+}
+
+static void coro_free(struct coro_sched *sched, struct coro *co)
+{
+    if (sched->nstacks < CORO_POOLED)
+        sched->stacks[sched->nstacks++] = co->stack;
+    else
+        munmap(co->stack, CORO_STACK + pagesize);
+
+    free(co);
+    atomic_fetch_sub(&sched->live, 1);
+}
+
+static void coro_wake(struct coro_sched *sched, struct coro *co)
+{
+    if (co->state != CORO_WAITING) return;  // another of its fds already woke it
+
+    if (co->deadline != -1) {
+        if (co->tprev != NULL) co->tprev->tnext = co->tnext;
+        else sched->timed = co->tnext;
+        if (co->tnext != NULL) co->tnext->tprev = co->tprev;
+    }
+
+    co->state = CORO_READY;
+    runq_push(sched, co);
+}
+
+static void runq_push(struct coro_sched *sched, struct coro *co)
+{
+    co->next = NULL;
+    if (sched->runq_tail == NULL) {
+        sched->runq_head = co;
+    } else {
+        sched->runq_tail->next = co;
+    }
+    sched->runq_tail = co;
+}
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,57 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <pthread.h>
+#include <poll.h>
+#include "tpool.h"
+
+/**
+ * @brief Turn workers of a threadpool into coroutine schedulers
+ *
+ * @example
+ *
+ *      ..
+ *      tpool_t *tpool = tpool_create(4);
+ *      coro_start(tpool, 4);
+ *      ..
+ *      coro_spawn(handler, arg);
+ *      ..
+ *
+ * Each scheduler occupies one worker for good and runs the coroutines
+ * given to it on that worker only, so a coroutine never changes threads.
+ *
+ * @param  tpool, the threadpool whose workers will run the schedulers
+ * @param  num,   the number of schedulers, at most the number of workers
+ * @return 0 for success and -1 otherwise
+ */
+
+int coro_start(tpool_t *tpool, int num);
+
+/**
+ * @brief Run func(arg) as a coroutine on the least busy scheduler
+ *
+ * func may call coro_poll, directly or through rio, wherever it would
+ * otherwise block; only its coroutine waits, not the worker.
+ *
+ * @param   func  a function pointer
+ * @param   arg   argument(s) can be passed as pointers
+ * @return  0 for success and -1 otherwise
+ */
+
+int coro_spawn(thr_func_t func, void *arg);
+
+/**
+ * @brief poll(2) that parks the calling coroutine instead of its thread
+ *
+ * Outside a coroutine this is plain poll.
+ */
+
+int coro_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+/**
+ * @brief Nonzero when called from inside a coroutine
+ */
+
+int coro_active(void);
+
+#endif
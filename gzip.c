@@ -0,0 +1,120 @@
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "gzip.h"
+
+#define GZIP_WINDOW   15            /* log2 of the history window, 9..15 */
+#define GZIP_MEMLEVEL 8             /* 1..9, deflate needs about (1 << (WINDOW + 2)) + (1 << (MEMLEVEL + 9)) bytes */
+
+static long stat_streams, stat_in, stat_out, stat_cpu_ns;
+static pthread_mutex_t gzip_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long cpu_ns();
+static void account(z_stream *zs, long ns);
+
+int gzip_init(struct gzip_enc *gz, int level)
+{
+    memset(gz, 0, sizeof(*gz));
+
+    /* 16 + window bits asks for a gzip header and trailer instead of zlib's */
+    if (deflateInit2(&gz->zs, level, Z_DEFLATED, 16 + GZIP_WINDOW, GZIP_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "gzip: deflateInit2 failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+int gzip_feed(struct gzip_enc *gz, const char *data, size_t n, int finish,
+              gzip_out_t out, void *ctx)
+{
+    char buf[GZIP_OUTMAX];
+    int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+    int rc;
+    long start;
+
+    gz->zs.next_in = (Bytef *) data;
+    gz->zs.avail_in = (uInt) n;
+
+    do {
+        gz->zs.next_out = (Bytef *) buf;
+        gz->zs.avail_out = sizeof(buf);
+
+        start = cpu_ns();
+        rc = deflate(&gz->zs, flush);
+        gz->cpu_ns += cpu_ns() - start;
+        if (rc == Z_STREAM_ERROR) return -1;
+
+        if (gz->zs.avail_out < sizeof(buf) &&
+            out(ctx, buf, sizeof(buf) - gz->zs.avail_out) != 0)
+            return -1;
+    } while (gz->zs.avail_out == 0 || (finish && rc != Z_STREAM_END));
+
+    return 0;
+}
+
+void gzip_end(struct gzip_enc *gz)
+{
+    account(&gz->zs, gz->cpu_ns);
+    deflateEnd(&gz->zs);
+}
+
+size_t gzip_bound(size_t n)
+{
+    /* deflateBound with zlib's wrapper, plus what gzip's takes beyond it */
+    return compressBound((uLong) n) + 18;
+}
+
+int gzip_buffer(char *dst, size_t *dstlen, const char *src, size_t n, int level)
+{
+    z_stream zs;
+    long start = cpu_ns();
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, 16 + GZIP_WINDOW, GZIP_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    zs.next_in = (Bytef *) src;
+    zs.avail_in = (uInt) n;
+    zs.next_out = (Bytef *) dst;
+    zs.avail_out = (uInt) gzip_bound(n);
+    rc = deflate(&zs, Z_FINISH);
+    *dstlen = zs.total_out;
+
+    account(&zs, cpu_ns() - start);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END ? 0 : -1;
+}
+
+void gzip_report(FILE *out)
+{
+    pthread_mutex_lock(&gzip_mutex);
+    fprintf(out, "gzip: %ld responses, %ld bytes in, %ld out, %ld saved (%ld%%), %ld ms cpu\n",
+            stat_streams, stat_in, stat_out, stat_in - stat_out,
+            stat_in ? (stat_in - stat_out) * 100 / stat_in : 0, stat_cpu_ns / 1000000);
+    pthread_mutex_unlock(&gzip_mutex);
+}
+
+/*
+ * Static functions
+ */
+
+static long cpu_ns()
+/* of this thread, so time spent waiting on sockets is not counted */
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void account(z_stream *zs, long ns)
+{
+    pthread_mutex_lock(&gzip_mutex);
+    stat_streams++;
+    stat_in += (long) zs->total_in;
+    stat_out += (long) zs->total_out;
+    stat_cpu_ns += ns;
+    pthread_mutex_unlock(&gzip_mutex);
+}
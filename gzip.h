@@ -0,0 +1,41 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <zlib.h>
+
+/*
+ * gzip content-coding on top of zlib. A stream is compressed a piece at
+ * a time with a fixed amount of memory (see GZIP_WINDOW and
+ * GZIP_MEMLEVEL in gzip.c); compressed output is handed to a callback
+ * as it is produced.
+ */
+
+#define GZIP_OUTMAX (16 * 1024)    /* most compressed bytes handed out at once */
+
+// called with each piece of compressed output, nonzero stops gzip_feed
+typedef int (*gzip_out_t)(void *ctx, const char *data, size_t n);
+
+struct gzip_enc {
+    z_stream zs;
+    long     cpu_ns;    // spent in deflate
+};
+
+// 0, or -1 if zlib could not be set up
+int     gzip_init(struct gzip_enc *gz, int level);
+// compress n bytes, and everything still buffered if finish is set; -1 on error
+int     gzip_feed(struct gzip_enc *gz, const char *data, size_t n, int finish,
+                  gzip_out_t out, void *ctx);
+// release the stream and count it in gzip_report
+void    gzip_end(struct gzip_enc *gz);
+
+// the most gzip_buffer can make of n bytes
+size_t  gzip_bound(size_t n);
+// compress all of src into dst, which holds gzip_bound(n) bytes; -1 on error
+int     gzip_buffer(char *dst, size_t *dstlen, const char *src, size_t n, int level);
+
+// responses compressed, bytes in and out, CPU time
+void    gzip_report(FILE *out);
+
+#endif
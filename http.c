@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
@@ -9,15 +10,41 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #include "colored_text.h"
 #include "http.h"
 #include "utils.h"
 #include "rio.h"
+#include "tpool.h"
+#include "upstream.h"
+#include "coro.h"
+#include "chunked.h"
+#include "cache.h"
+#include "sched.h"
+#include "rproxy.h"
+#include "prefetch.h"
+#include "probes.h"
+#include "gzip.h"
 
 #define LONGMAX 1024*8 /* a often-used limit for the size of a HTTP request */
 #define LLMAX 65535    /* the size of a Full Request */
 #define SHORTMAX 512
+#define HEADERMAX (LONGMAX - SHORTMAX - 16) /* request headers, leaving room for the request line */
+
+#define RELAYMAX     (64 * 1024) /* bytes moved per read when relaying a body */
+
+#define ZEROCOPY     0           /* send large bodies with MSG_ZEROCOPY */
+#define ZEROCOPY_MIN (64 * 1024) /* below this, pinning pages costs more than copying */
+
+#define GZIP_LEVEL   0           /* 1-9, compress text for clients that take gzip; 0 never */
+#define GZIP_MIN     1024        /* bytes, smaller bodies gain too little */
+#define GZIP_MAX     (64 * 1024 * 1024) /* bytes, larger ones are sent as they are; 0 for no limit */
+
+#define PREFETCH     0           /* fetch the links of cacheable pages into the cache */
+
+#define BUSY_RETRY   1           /* seconds, Retry-After when an origin's queue is full */
+#define BACKEND_TRIES 3          /* backends tried for one request in reverse-proxy mode */
 
 /*
  * TODO 
@@ -28,6 +55,67 @@
 
 static int  parse_url(char *url, char *hostname, char *rest);
 static void proxy_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+static void proxy_error_hdr(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, char *extra);
+static int  error_page(char *dst, char *cause, char *errnum, char *shortmsg, char *longmsg, char *extra);
+static void cache_send(int fd, struct cache_obj *obj, const char *saved_headers);
+static void cache_answer(int fd, struct cache_obj *obj, const char *saved_headers);
+static struct cache_obj *gzip_variant(struct cache_obj *obj);
+static int  accepts_gzip(const char *headers);
+static int  gzip_wanted(const char *head, long length);
+static int  gzip_head(const char *head, char *dst, int http11);
+static void gzip_key(char *dst, const char *url);
+static int  not_modified(struct cache_obj *obj, const char *inm, const char *ims);
+static int  parse_range(const char *spec, size_t len, size_t *first, size_t *last);
+static int  fill_start(const char *url, int prefetch);
+static int  prefetch_fetch(const char *url);
+static void fill_job(void *arg);
+static void proxy_forward(void *arg);
+
+/*
+ * what proxy_forward needs of a request that proxy_connect has read,
+ * kept on the heap while the request waits for its turn at the origin
+ */
+struct proxy_req {
+    int     fd;
+    struct rio_t rio;               // may already hold some of the request body
+    char    url[SHORTMAX];
+    char    version[SHORTMAX];
+    char    hostname[SHORTMAX];     // host[:port]
+    char    rest[SHORTMAX];
+    char    saved_headers[LONGMAX]; // anything following the startline
+    char    client_headers[LONGMAX];// as sent, saved_headers may be rewritten
+    long    request_length;
+    int     request_chunked;
+    int     use_cache;
+    struct cache_obj *cached;       // stale copy to revalidate, or NULL
+    struct backend *backend;        // reverse-proxy mode, where it goes
+    char    vhost[SHORTMAX];        // and the Host it was routed by
+    int     backend_result;         // for rproxy_done
+};
+
+static void proxy_end(struct proxy_req *req);
+
+static void (*conn_done)(void);
+
+struct body_copy {
+    char   *data;
+    size_t  len;
+    size_t  cap;
+    int     failed;     // too large to keep or out of memory
+    struct link_scan *scan;  // an HTML page being scanned for prefetching, or NULL
+    int     throttle;   // a prefetch, keep to its bandwidth
+};
+
+/* compressing a body on its way to the client */
+struct relay_gzip {
+    struct gzip_enc   enc;
+    int               chunked;  // frame the output as chunks, for a HTTP/1.1 client
+    struct body_copy *copy;     // collects the compressed body, may be NULL
+};
+
+static long relay_body(struct rio_t *from, int to, char *head, size_t headlen,
+                       long length, int chunked, int dechunk, struct body_copy *copy,
+                       struct relay_gzip *gz, char *buf, size_t bufsize);
 
 /*
  * BACKGROUND
@@ -58,31 +146,45 @@ void proxy_connect(int fd)
      *     ^                                                                            | [read, parse]
      *     |----------------------------------------------------------------- [write] proxy
      *
-     * Currently, threads use synchronous blocking I/O when dealing with remote servers
+     * Currently, threads use synchronous blocking I/O when dealing with remote servers.
+     * Reading and parsing happen here; the part that waits on the origin,
+     * proxy_forward, is queued behind other requests to the same origin
      */
 
-    struct rio_t rio;
-    char method[SHORTMAX], url[SHORTMAX], version[SHORTMAX];
+    struct proxy_req *req = (struct proxy_req *) calloc(1, sizeof(struct proxy_req));
+    if (req == NULL) {
+        perror("calloc");
+        close(fd);
+        if (conn_done != NULL) conn_done();
+        return;
+    }
+    req->fd = fd;
+
+    struct rio_t *rio = &req->rio;
+    char method[SHORTMAX], *url = req->url, *version = req->version;
     char buf[LONGMAX];
 
-    char hostname[SHORTMAX] = {0}, rest[SHORTMAX] = {0};
-    char saved_headers[LONGMAX] = {0}; // anything following the startline
+    char *hostname = req->hostname, *rest = req->rest;
+    char *saved_headers = req->saved_headers;
 
-    rio_readinitb(&rio, fd);
+    rio_readinitb(rio, fd);
 
     fprintf(stderr, "parsing HTTP request from client\n");
 
-    int rc = rio_readlineb(&rio, buf, LONGMAX);
+    int rc = rio_readlineb(rio, buf, LONGMAX);
     if (rc == -1) {
-        if (errno != EAGAIN) {// neither EAGAIN nor EINTR
+        if (errno == ETIMEDOUT) {  // see RIO_TIMEOUT
+            proxy_error(fd, "request", "408", "Request Timeout", "Request Not Received In Time");
+        } else if (errno != EAGAIN) {// neither EAGAIN nor EINTR
             /*
              * not sure what might happen yet, print error and
              * stop reading for later investigation should any
              * error occurs
              */
             perror("rio_readlineb");
-            close(fd); // TODO
-        } 
+        }
+        proxy_end(req); // TODO
+        return;
     }
 
     sscanf(buf, "%s %s %s", method, url, version);
@@ -90,139 +192,884 @@ void proxy_connect(int fd)
     if (strcasecmp(method, "GET")) {
         fprintf(stderr, "parser: unsupported http method\n");
         proxy_error(fd, method, "501", "Unsupported Method", "HTTP Method Not Supported");
-        close(fd);
+        proxy_end(req);
         return;
     }
 
-    int error = parse_url(url, hostname, rest);
+    /* origin-form ("GET /index.html") is for us to route in reverse-proxy mode */
+    int error = rproxy_enabled() && url[0] == '/' ? 0 : parse_url(url, hostname, rest);
     if (error) {  // HTTPS or unusually long hostname
         proxy_error(fd, method, "501", "Unsupported Method", "HTTP Method Not Supported");
-        close(fd);  //TODO: will closing them affect other connections?
+        proxy_end(req);  //TODO: will closing them affect other connections?
         return;
     }
     
     fprintf(stderr, "remote server address confirmed, %s\n", hostname);
 
     char request_rest_buf[SHORTMAX];
+    long request_length = -1;
+    int request_chunked = 0;
     do {
         /* 
          * currently we can handle one request at a time, even though it's possible for 
          * a socket to have multiple requests waiting and the rest of the connects will
          * have to wait for another epoll notification
          */
-        rc = rio_readlineb(&rio, request_rest_buf, SHORTMAX);
-        if (rc < 0) break;
+        rc = rio_readlineb(rio, request_rest_buf, SHORTMAX);
+        if (rc <= 0) break;
+        if (!strncasecmp(request_rest_buf, "Content-length:", 15))
+            request_length = atol(request_rest_buf + 15);
+        else if (!strncasecmp(request_rest_buf, "Transfer-Encoding:", 18) &&
+                 strcasestr(request_rest_buf + 18, "chunked"))
+            request_chunked = 1;
+        if (strlen(saved_headers) + rc >= HEADERMAX) {
+            fprintf(stderr, "request header too long\n");
+            proxy_error(fd, method, "431", "Request Header Fields Too Large", "Request Header Too Long");
+            proxy_end(req);
+            return;
+        }
         strcat(saved_headers, request_rest_buf);
     } while (strcmp(request_rest_buf, "\r\n"));
     if (rc == -1) {
-        if (errno != EAGAIN) {// neither EAGAIN nor EINTR
+        if (errno == ETIMEDOUT) {
+            proxy_error(fd, "request", "408", "Request Timeout", "Request Not Received In Time");
+            proxy_end(req);
+            return;
+        } else if (errno != EAGAIN) {// neither EAGAIN nor EINTR
             /*
              * not sure what might happen yet, print error and
              * stop reading for later investigation should any
              * error occurs
              */
             perror("rio_readlineb");
-            close(fd);
+            proxy_end(req);
             return;
         } 
     }
 
-    // send request and wait for a response
+    int keyed = 1;  // url identifies the object, for the cache
 
-    fprintf(stderr, "forwarding request to a remote server\n");
+    if (rproxy_enabled()) {
+        /* the target names one of our services rather than an origin, find it a backend */
+        if (url[0] == '/') {
+            if (!header_get(saved_headers, "Host", hostname, SHORTMAX))
+                hostname[0] = '\0';
+            snprintf(rest, SHORTMAX, "%s", url);
+            keyed = snprintf(url, SHORTMAX, "http://%s%s", hostname, rest) < SHORTMAX;
+        }
+        snprintf(req->vhost, SHORTMAX, "%s", hostname);
+        if ((req->backend = rproxy_route(hostname, rest, NULL)) == NULL) {
+            fprintf(stderr, "rproxy: no route for %s%s\n", hostname, rest);
+            proxy_error(fd, hostname, "502", "Bad Gateway", "No Backend For This Request");
+            proxy_end(req);
+            return;
+        }
+        fprintf(stderr, "rproxy: %s%s -> %s\n", hostname, rest, req->backend->addr);
+        snprintf(hostname, SHORTMAX, "%s", req->backend->addr);
+    }
 
-    int sockfd, numbytes;
-    char reverse_buf[LONGMAX];
-    struct addrinfo hints, *servlist, *serv;
-    int err;
-    char s[INET6_ADDRSTRLEN];
+    PROBE3(request_parsed, fd, url, hostname);
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    // answer from the cache if we can
 
-    if ((err = getaddrinfo(hostname, "80", &hints, &servlist))) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
-        return;
-    }
+    char val[SHORTMAX];
+    char inm[SHORTMAX] = {0}, ims[SHORTMAX] = {0};  // the client's own conditionals
+    struct cache_obj *cached = NULL;
+    int use_cache = keyed && request_length <= 0 && !request_chunked &&
+                    !header_get(saved_headers, "Authorization", val, sizeof(val));
+    int no_cache = (header_get(saved_headers, "Cache-Control", val, sizeof(val)) && strcasestr(val, "no-cache")) ||
+                   (header_get(saved_headers, "Pragma", val, sizeof(val)) && strcasestr(val, "no-cache"));
 
-    for (serv = servlist; serv != NULL; serv = serv->ai_next) {
-        if ((sockfd = socket(serv->ai_family, serv->ai_socktype, serv->ai_protocol)) == -1) {
-            perror("client: socket");
-            continue;
-        }
+    header_get(saved_headers, "If-None-Match", inm, sizeof(inm));
+    header_get(saved_headers, "If-Modified-Since", ims, sizeof(ims));
 
-        if (connect(sockfd, serv->ai_addr, serv->ai_addrlen) == -1) {
-            close(sockfd);
-            perror("client: connect");
-            continue;
+    if (use_cache && !no_cache && (cached = cache_lookup(url)) != NULL) {
+        if (cache_fresh(cached)) {
+            fprintf(stderr, "cache: hit %s\n", url);
+            PROBE2(cache_hit, fd, url);
+            if (atomic_exchange(&cached->prefetched, 0))
+                prefetch_hit();
+            cache_answer(fd, cached, saved_headers);
+            cache_release(cached);
+            proxy_end(req);
+            return;
+        }
+        if (cached->etag[0] == '\0' && cached->last_modified[0] == '\0') {
+            cache_release(cached);  // stale and nothing to revalidate it with
+            cached = NULL;
         }
-        break;
     }
 
-    if (serv == NULL) {
+    strcpy(req->client_headers, saved_headers);
+
+    if (use_cache && cached == NULL && header_get(saved_headers, "Range", val, sizeof(val))) {
+        /*
+         * the range goes to the origin as is, and the whole object
+         * is fetched in the background so that later ranges hit
+         */
+        proxy_fill(url);
+    }
+
+    req->request_length = request_length;
+    req->request_chunked = request_chunked;
+    req->use_cache = use_cache;
+    req->cached = cached;
+
+    /*
+     * coroutines only hold a worker while they run, there is nothing
+     * to schedule; otherwise wait for the origin's turn
+     */
+    if (coro_active()) {
+        proxy_forward(req);
+    } else if (sched_submit(hostname, proxy_forward, req) == -1) {
+        fprintf(stderr, "sched: too much waiting for %s already\n", hostname);
+        proxy_busy(fd, BUSY_RETRY);
+        proxy_end(req);
+    }
+}
+
+static void proxy_forward(void *arg)
+/* the rest of proxy_connect: send request and wait for a response */
+{
+    struct proxy_req *req = arg;
+    int fd = req->fd;
+    char buf[LONGMAX];
+    char *url = req->url, *version = req->version;
+    char *hostname = req->hostname, *rest = req->rest;
+    char *saved_headers = req->saved_headers;
+    char *client_headers = req->client_headers;
+    long request_length = req->request_length;
+    int request_chunked = req->request_chunked;
+    int use_cache = req->use_cache;
+    struct cache_obj *cached = req->cached;
+    int rc;
+
+    fprintf(stderr, "forwarding request to a remote server\n");
+
+    int sockfd;
+    int tries = 1;
+    char *port = "80";
+    char *colon = strrchr(hostname, ':');
+
+    if (req->backend != NULL) {
+        hostname = req->backend->host;
+        port = req->backend->port;
+    } else if (colon != NULL && hostname[0] != '[') {  // host:port, leave IPv6 literals alone
+        *colon = '\0';
+        port = colon + 1;
+    }
+
+    PROBE2(upstream_start, fd, hostname);
+    while ((sockfd = upstream_connect(hostname, port)) == -1) {
         fprintf(stderr, "client, failed to connect\n");
-        close(fd);
-        return;
+        req->backend_result = -1;
+
+        /* nothing has been sent, so another backend of the group may as well have it */
+        struct backend *next = NULL;
+        if (req->backend != NULL && tries++ < BACKEND_TRIES)
+            next = rproxy_route(req->vhost, rest, req->backend);
+        if (next == NULL) {
+            /* a backend's address is ours to know, name the site the client asked for */
+            proxy_error(fd, req->backend != NULL ? req->vhost : hostname,
+                        "502", "Bad Gateway", "Could Not Reach Remote Server");
+            proxy_end(req);
+            return;
+        }
+        fprintf(stderr, "rproxy: %s unreachable, trying %s\n", req->backend->addr, next->addr);
+        rproxy_done(req->backend, -1);
+        req->backend = next;
+        req->backend_result = 0;
+        hostname = next->host;
+        port = next->port;
     }
+    req->backend_result = -1;  // until it has answered
+    PROBE2(upstream_connected, fd, sockfd);
 
-    inet_ntop(serv->ai_family, get_in_addr((struct sockaddr *) serv->ai_addr), s, sizeof(s));
-    printf("remote server found %s\n", s);
+    if (cached != NULL) {
+        /* stale, ask the origin whether our copy is still good instead of refetching */
+        fprintf(stderr, "cache: revalidating %s\n", url);
+        header_strip(saved_headers, "If-None-Match");
+        header_strip(saved_headers, "If-Modified-Since");
+        header_strip(saved_headers, "If-Range");
+        header_strip(saved_headers, "Range");   // if it changed, we want all of it
 
-    freeaddrinfo(servlist);
+        char validators[SHORTMAX * 2];  // etag and last_modified are far shorter
+        int n = 0;
+        if (cached->etag[0] != '\0')
+            n += snprintf(validators + n, sizeof(validators) - n, "If-None-Match: %s\r\n", cached->etag);
+        if (cached->last_modified[0] != '\0')
+            n += snprintf(validators + n, sizeof(validators) - n, "If-Modified-Since: %s\r\n", cached->last_modified);
+
+        /* reopen the header block, if it was closed by a blank line and there is room */
+        size_t len = strlen(saved_headers);
+        int closed = len == 2 ? !strcmp(saved_headers, "\r\n") :
+                     len >= 4 && !strcmp(saved_headers + len - 4, "\r\n\r\n");
+        if (closed && len + n < HEADERMAX) {
+            snprintf(saved_headers + len - 2, HEADERMAX - (len - 2), "%s\r\n", validators);
+        } else {
+            fprintf(stderr, "cache: no room to revalidate %s, fetching it whole\n", url);
+            cache_release(cached);
+            req->cached = cached = NULL;
+        }
+    }
 
     char forward_header[LONGMAX] = {0};
 
-    // Undefined behavious may occur if the request contains a body
+    /*
+     * speak the client's version upstream: a HTTP/1.1 origin may then
+     * answer chunked, which the client understands too
+     */
+    int http11 = !strcasecmp(version, "HTTP/1.1");
 
     fprintf(stderr, "target: %s\n", rest);
-    sprintf(forward_header, "GET %s HTTP/1.0\r\n", rest);
-    strcat(forward_header, saved_headers);
+    if (snprintf(forward_header, LONGMAX, "GET %s %s\r\n%s", rest, http11 ? "HTTP/1.1" : "HTTP/1.0",
+                 saved_headers) >= LONGMAX) {
+        proxy_error(fd, "GET", "431", "Request Header Fields Too Large", "Request Header Too Long");
+        close(sockfd);
+        proxy_end(req);
+        return;
+    }
 
     fprintf(stderr, BOLDBLUE "header generated:\n%s" RESET, forward_header);
-    
-    rio_writen(sockfd, forward_header, strlen(forward_header));
+
+    /*
+     * the worker's own buffer lives on its NUMA node and saves a malloc,
+     * but coroutines sharing a worker would share it too
+     */
+    size_t relay_size;
+    char *local_buf = coro_active() ? NULL : tpool_local(&relay_size);
+    char *relay_buf = local_buf;
+    if (local_buf == NULL || relay_size < RELAYMAX) {
+        relay_size = RELAYMAX;
+        relay_buf = (char *) malloc(relay_size);
+    }
+
+    // a request body, if any, follows the header
+
+    if ((request_length > 0 || request_chunked) &&
+        relay_body(&req->rio, sockfd, forward_header, strlen(forward_header),
+                   request_length, request_chunked, 0, NULL, NULL, relay_buf, relay_size) == -1) {
+        perror("relay_body (request)");
+        goto done;
+    } else if (request_length <= 0 && !request_chunked) {
+        rio_writen(sockfd, forward_header, strlen(forward_header));
+    }
 
     // forward the response back to our client
 
     char response_header[LONGMAX] = {0};
-    char response_body_lenth_c[SHORTMAX] = {0};
-    int response_body_length;
+    long response_length = -1;
+    int response_chunked = 0;
+    int status = 0;
 
-    // read the entire response
     struct rio_t rio_response;
     rio_readinitb(&rio_response, sockfd);
     rc = rio_readlineb(&rio_response, buf, LONGMAX);
+    if (rc <= 0) {
+        perror("rio_readlineb trying to read response");
+        goto done;
+    }
+    sscanf(buf, "%*s %d", &status);
     strcat(response_header, buf);
-    while (rc = rio_readlineb(&rio_response, buf, LONGMAX) && rc > 0  && strcmp(buf, "\r\n")) {
-        if (!strncasecmp(buf, "Content-length", 14)) {
-            strcpy(response_body_lenth_c, buf + 15);
-            response_body_length = atoi(response_body_lenth_c);
+    req->backend_result = status >= 500 ? -1 : 1;
+    PROBE2(first_byte, fd, status);
+
+    while ((rc = rio_readlineb(&rio_response, buf, LONGMAX)) > 0 && strcmp(buf, "\r\n")) {
+        if (!strncasecmp(buf, "Content-length:", 15)) {
+            response_length = atol(buf + 15);
+        } else if (!strncasecmp(buf, "Transfer-Encoding:", 18) && strcasestr(buf + 18, "chunked")) {
+            response_chunked = 1;
+            if (!http11) continue;  // decoded below, the client would not understand it
+        }
+        if (strlen(response_header) + rc + 3 > LONGMAX) {
+            fprintf(stderr, "response header too long\n");
+            goto done;
         }
         strcat(response_header, buf);
     }
-    if (rc == -1) {
+    if (rc <= 0) {
         perror("rio_readlineb trying to read response");
-        close(fd);
-        return;
+        goto done;
+    }
+    if (response_chunked) {
+        response_length = -1;   // chunked wins over Content-length, RFC 9112 6.3
+        header_strip(response_header, "Content-Length");  // and may not be sent along with it
+        if (!http11) strcat(response_header, "Connection: close\r\n");
     }
     strcat(response_header, "\r\n");
     fprintf(stderr, BOLDCYAN "finished reading response header\n%s" RESET, response_header);
 
-    rio_writen(fd, response_header, strlen(response_header));
-    char *response_body_buffer = (char *) malloc(response_body_length * sizeof(char));
+    if (cached != NULL && status == 304) {
+        /* still good, serve our copy for another freshness lifetime */
+        fprintf(stderr, "cache: %s not modified\n", url);
+        cache_refresh(cached, response_header);
+        if (atomic_exchange(&cached->prefetched, 0))
+            prefetch_hit();
+        cache_answer(fd, cached, client_headers);
+        PROBE3(response_complete, fd, status, (long) cached->bodylen);
+        goto done;
+    }
+
+    if ((status >= 100 && status < 200) || status == 204 || status == 304)
+        response_length = 0;    // never a body, whatever the header says
 
-    rc = rio_readnb(&rio_response, response_body_buffer, response_body_length);
-    fprintf(stderr, "response body length (actual): %d\n", rc);
+    /* keep a copy of the body on the way through if we may store it */
+    struct body_copy copy = { .data = NULL };
+    int store = use_cache && cache_storable(response_header);
+    if (store && response_length > 0) {
+        copy.cap = response_length;
+        copy.data = (char *) malloc(copy.cap);
+    }
+
+    struct link_scan scan;
+    char type[SHORTMAX];
+    if (PREFETCH && store && header_get(response_header, "Content-Type", type, sizeof(type)) &&
+        !strncasecmp(type, "text/html", 9)) {
+        prefetch_page(&scan, url);
+        copy.scan = &scan;
+    }
+
+    /* compress it on the way if the client takes gzip and it is worth it */
+    struct relay_gzip gz;
+    struct body_copy gzcopy = { .data = NULL };
+    char gzip_header[LONGMAX];
+    int gzip = GZIP_LEVEL > 0 && status == 200 && accepts_gzip(client_headers) &&
+               gzip_wanted(response_header, response_length) &&
+               gzip_head(response_header, gzip_header, http11) == 0 &&
+               gzip_init(&gz.enc, GZIP_LEVEL) == 0;
+    if (gzip) {
+        gz.chunked = http11;
+        gz.copy = store ? &gzcopy : NULL;
+    }
 
-    rio_writen(fd, response_body_buffer, response_body_length);
-    //fprintf(stderr, "response body is as follows: \n%s", response_body_buffer);
-    free(response_body_buffer);
+    char *head = gzip ? gzip_header : response_header;
+    long sent = relay_body(&rio_response, fd, head, strlen(head),
+                           response_length, response_chunked && response_length != 0,
+                           !http11, store ? &copy : NULL, gzip ? &gz : NULL, relay_buf, relay_size);
+    fprintf(stderr, "response body length (actual): %ld\n", sent);
+    PROBE3(response_complete, fd, status, sent);
+    if (gzip)
+        gzip_end(&gz.enc);
+
+    if (store && sent >= 0 && !copy.failed) {
+        struct cache_obj *obj = cache_insert(url, response_header, copy.data, copy.len);
+        fprintf(stderr, "cache: stored %s (%zu bytes)\n", url, copy.len);
+
+        /* keep what we compressed too, so the next client that takes gzip gets it as is */
+        if (obj != NULL && gzip && !gzcopy.failed) {
+            char key[SHORTMAX + 8];
+            gzip_key(key, url);
+            struct cache_obj *variant = cache_insert(key, gzip_header, gzcopy.data, gzcopy.len);
+            if (variant != NULL) variant->derived = obj->serial;
+            cache_release(variant);
+            gzcopy.data = NULL;
+        }
+        cache_release(obj);
+    } else {
+        free(copy.data);
+    }
+    free(gzcopy.data);
+
+done:
+    if (relay_buf != local_buf)
+        free(relay_buf);
     close(sockfd);
-    close(fd);
+    proxy_end(req);
+}
+
+static void proxy_end(struct proxy_req *req)
+{
+    PROBE1(request_done, req->fd);
+    rproxy_done(req->backend, req->backend_result);
+    cache_release(req->cached);
+    close(req->fd);
+    free(req);
+    if (conn_done != NULL) conn_done();
+}
+
+static void cache_send(int fd, struct cache_obj *obj, const char *saved_headers)
+/*
+ * answer from the cache: a bodiless 304 if the client's copy is current,
+ * the part asked for if the client sent a Range we can satisfy, or all of it
+ */
+{
+    char head[LONGMAX];
+    char inm[SHORTMAX] = {0}, ims[SHORTMAX] = {0};
+    char range[SHORTMAX], if_range[SHORTMAX];
+    size_t first = 0, last = 0;   // set by parse_range, only for a 206
+    int partial = -1;   // no usable Range, send it all
+    int n;
+
+    header_get(saved_headers, "If-None-Match", inm, sizeof(inm));
+    header_get(saved_headers, "If-Modified-Since", ims, sizeof(ims));
+
+    if (not_modified(obj, inm, ims)) {
+        n = sprintf(head, "HTTP/1.1 304 Not Modified\r\n");
+        if (obj->etag[0] != '\0')
+            n += sprintf(head + n, "ETag: %s\r\n", obj->etag);
+        if (obj->last_modified[0] != '\0')
+            n += sprintf(head + n, "Last-Modified: %s\r\n", obj->last_modified);
+        n += sprintf(head + n, "Connection: close\r\n\r\n");
+        rio_writen(fd, head, n);
+        return;
+    }
+
+    if (header_get(saved_headers, "Range", range, sizeof(range))) {
+        /* If-Range asks for the range only if it is still the same object, strongly compared */
+        if (!header_get(saved_headers, "If-Range", if_range, sizeof(if_range)) ||
+            (if_range[0] == '"' ? !strcmp(if_range, obj->etag) : !strcmp(if_range, obj->last_modified)))
+            partial = parse_range(range, obj->bodylen, &first, &last);
+    }
+
+    if (partial == 0) {
+        n = sprintf(head,
+            "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%zu\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n", obj->bodylen);
+        rio_writen(fd, head, n);
+        return;
+    }
+
+    char *rest = obj->head;     // the stored head without its status line, for a 206
+    size_t restlen = obj->headlen;
+
+    if (partial == 1) {
+        rest = strchr(obj->head, '\n') + 1;
+        restlen -= rest - obj->head;
+        n = sprintf(head,
+            "Content-Range: bytes %zu-%zu/%zu\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", first, last, obj->bodylen, last - first + 1);
+    } else {
+        n = sprintf(head, "Content-Length: %zu\r\nConnection: close\r\n\r\n", obj->bodylen);
+    }
+
+    char *status = "HTTP/1.1 206 Partial Content\r\n";
+    size_t bodylen = partial == 1 ? last - first + 1 : obj->bodylen;
+    struct iovec iov[4] = {
+        { status, partial == 1 ? strlen(status) : 0 },
+        { rest, restlen },
+        { head, n },
+        { obj->body + first, bodylen },
+    };
+
+    if (ZEROCOPY && bodylen >= ZEROCOPY_MIN) {
+        /* our reference keeps the body alive until the kernel is done with it */
+        if (rio_writevn(fd, iov, 3) != -1)
+            rio_sendzc(fd, obj->body + first, bodylen);
+    } else {
+        rio_writevn(fd, iov, 4);
+    }
+}
+
+static int parse_range(const char *spec, size_t len, size_t *first, size_t *last)
+/*
+ * a single "bytes=" range against a body of len bytes: 1 and the range
+ * clamped to the body if satisfiable, 0 if not, -1 if it is something we
+ * answer with the whole body instead (other units, several ranges, junk)
+ */
+{
+    char *end;
+    unsigned long long a, b;
+
+    if (strncasecmp(spec, "bytes=", 6) || strchr(spec, ',') != NULL) return -1;
+    spec += 6;
+
+    if (*spec == '-') {  // the last N bytes
+        b = strtoull(spec + 1, &end, 10);
+        if (end == spec + 1 || *end != '\0') return -1;
+        if (b == 0 || len == 0) return 0;
+        *first = b >= len ? 0 : len - b;
+        *last = len - 1;
+        return 1;
+    }
+
+    a = strtoull(spec, &end, 10);
+    if (end == spec || *end != '-') return -1;
+    spec = end + 1;
+    if (*spec == '\0') {
+        b = len > 0 ? len - 1 : 0;
+    } else {
+        b = strtoull(spec, &end, 10);
+        if (*end != '\0' || b < a) return -1;
+    }
+
+    if (a >= len) return 0;
+    *first = a;
+    *last = b >= len ? len - 1 : b;
+    return 1;
+}
+
+static int not_modified(struct cache_obj *obj, const char *inm, const char *ims)
+/* does the client's If-None-Match or If-Modified-Since match obj? */
+{
+    char tag[SHORTMAX];
+    const char *p = inm, *end;
+    const char *etag = obj->etag;
+    time_t since, modified;
+
+    if (inm[0] != '\0') {  // takes precedence, RFC 9110 13.2.2
+        if (etag[0] == '\0') return 0;
+        if (!strncmp(etag, "W/", 2)) etag += 2;  // weak comparison
+
+        while (*p != '\0') {
+            while (*p == ' ' || *p == ',') p++;
+            if (*p == '*') return 1;
+            end = strchr(p, ',');
+            if (end == NULL) end = p + strlen(p);
+            while (end > p && end[-1] == ' ') end--;
+
+            snprintf(tag, sizeof(tag), "%.*s", (int) (end - p), p);
+            if (!strcmp(!strncmp(tag, "W/", 2) ? tag + 2 : tag, etag)) return 1;
+
+            p = end;
+            while (*p != '\0' && *p != ',') p++;
+        }
+        return 0;
+    }
+
+    if (ims[0] != '\0' && obj->last_modified[0] != '\0') {
+        since = http_date(ims);
+        modified = http_date(obj->last_modified);
+        return since != -1 && modified != -1 && modified <= since;
+    }
+
+    return 0;
+}
+
+static void cache_answer(int fd, struct cache_obj *obj, const char *saved_headers)
+/* cache_send, of the gzip variant of obj if the client takes it */
+{
+    struct cache_obj *variant = NULL;
+    char val[SHORTMAX];
+
+    /* a range is of the identity body, the client would resume a download with it */
+    if (GZIP_LEVEL > 0 && accepts_gzip(saved_headers) && gzip_wanted(obj->head, (long) obj->bodylen) &&
+        !header_get(saved_headers, "Range", val, sizeof(val)) &&
+        !header_get(saved_headers, "If-Range", val, sizeof(val)))
+        variant = gzip_variant(obj);
+
+    cache_send(fd, variant != NULL ? variant : obj, saved_headers);
+    cache_release(variant);
+}
+
+static struct cache_obj *gzip_variant(struct cache_obj *obj)
+/*
+ * obj compressed, from the cache if it was compressed before, made and
+ * stored next to obj if not; NULL if it cannot be had
+ */
+{
+    char key[SHORTMAX + 8];
+    char head[LONGMAX], gzhead[LONGMAX];
+    struct cache_obj *variant;
+    size_t len;
+    char *body;
+
+    gzip_key(key, obj->key);
+    if ((variant = cache_lookup(key)) != NULL) {
+        if (variant->derived == obj->serial) return variant;
+        cache_release(variant);  // made from an older version of obj
+    }
+
+    if (obj->headlen + 3 > sizeof(head)) return NULL;
+    sprintf(head, "%s\r\n", obj->head);
+    if (gzip_head(head, gzhead, 1) == -1) return NULL;
+
+    if ((body = (char *) malloc(gzip_bound(obj->bodylen))) == NULL) return NULL;
+    if (gzip_buffer(body, &len, obj->body, obj->bodylen, GZIP_LEVEL) == -1) {
+        free(body);
+        return NULL;
+    }
+
+    fprintf(stderr, "cache: compressed %s, %zu -> %zu bytes\n", obj->key, obj->bodylen, len);
+    if ((variant = cache_insert(key, gzhead, body, len)) != NULL) {
+        variant->derived = obj->serial;
+        variant->expires = obj->expires;  // as fresh as what it was made from
+    }
+    return variant;
+}
+
+static int accepts_gzip(const char *headers)
+/* gzip in Accept-Encoding, and not with q=0 */
+{
+    char val[SHORTMAX];
+    char *p;
+
+    if (!header_get(headers, "Accept-Encoding", val, sizeof(val)) || (p = strcasestr(val, "gzip")) == NULL)
+        return 0;
+
+    p += 4;
+    while (*p == ' ') p++;
+    if (*p != ';') return 1;
+    if ((p = strcasestr(p, "q=")) == NULL) return 1;
+    return atof(p + 2) > 0;
+}
+
+static int gzip_wanted(const char *head, long length)
+/* text, JSON or JavaScript, not encoded already, neither too small nor too large */
+{
+    char val[SHORTMAX];
+
+    if (header_get(head, "Content-Encoding", val, sizeof(val)) ||
+        header_get(head, "Content-Range", val, sizeof(val)))
+        return 0;
+    if (header_get(head, "Cache-Control", val, sizeof(val)) && strcasestr(val, "no-transform"))
+        return 0;
+    if (length >= 0 && (length < GZIP_MIN || (GZIP_MAX > 0 && length > GZIP_MAX)))
+        return 0;   // a length of -1 is unknown, it is compressed as it comes
+
+    if (!header_get(head, "Content-Type", val, sizeof(val)))
+        return 0;
+    return !strncasecmp(val, "text/", 5) || strcasestr(val, "json") != NULL ||
+           strcasestr(val, "javascript") != NULL;
+}
+
+static int gzip_head(const char *head, char *dst, int http11)
+/*
+ * the response head for head's body compressed: no length, a weak ETag
+ * since the bytes differ, and chunked for a HTTP/1.1 client or closed
+ * at the end for others. -1 if it does not fit in LONGMAX
+ */
+{
+    char etag[SHORTMAX] = {0}, vary[SHORTMAX] = {0};
+    size_t len = strlen(head);
+
+    if (len >= LONGMAX) return -1;
+    strcpy(dst, head);
+    header_get(dst, "ETag", etag, sizeof(etag));
+    header_get(dst, "Vary", vary, sizeof(vary));
+    header_strip(dst, "Content-Length");
+    header_strip(dst, "Transfer-Encoding");
+    header_strip(dst, "Connection");
+    header_strip(dst, "ETag");
+    header_strip(dst, "Vary");
+
+    len = strlen(dst) - 2;  // reopen the header block
+    if (len + strlen(etag) + strlen(vary) + 128 > LONGMAX) return -1;
+
+    if (etag[0] != '\0')
+        len += sprintf(dst + len, "ETag: %s%s\r\n", etag[0] == '"' ? "W/" : "", etag);
+    if (strcasestr(vary, "Accept-Encoding") != NULL)
+        len += sprintf(dst + len, "Vary: %s\r\n", vary);
+    else
+        len += sprintf(dst + len, "Vary: %s%sAccept-Encoding\r\n", vary, vary[0] ? ", " : "");
+    len += sprintf(dst + len, "Content-Encoding: gzip\r\n%s\r\n",
+                   http11 ? "Transfer-Encoding: chunked\r\n" : "Connection: close\r\n");
+    return 0;
+}
+
+static void gzip_key(char *dst, const char *url)
+/* where the gzip variant of url is kept in the cache */
+{
+    sprintf(dst, "gzip %s", url);
+}
+
+void proxy_busy(int fd, int retry_after)
+{
+    char buf[LONGMAX * 2];
+    char extra[SHORTMAX];
+
+    /*
+     * fd is nonblocking, so this only swallows what has already arrived;
+     * closing a socket with unread data resets the connection and the
+     * client may never see the 503
+     */
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    /* once, without waiting: this runs on the event loop, a client that does not read gets nothing */
+    sprintf(extra, "Retry-After: %d\r\n", retry_after);
+    int n = error_page(buf, "proxy", "503", "Service Unavailable", "Server Overloaded", extra);
+    send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * Background fill
+ *
+ * A Range request that misses is passed to the origin as is, which helps
+ * the client but not the cache. proxy_fill fetches the whole object on
+ * the side so that later ranges of it are served from memory. Fills of
+ * the same url are not duplicated and only FILL_MAX run at a time, and
+ * never more than the scheduler has slots, so that they cannot take up
+ * more workers than foreground requests may.
+ */
+
+#define FILL_MAX 8
+
+struct fill {
+    char    url[SHORTMAX];  // in flight, "" if the slot is free
+    int     prefetch;       // started by prefetch_pump, report back to it
+};
+
+static pthread_mutex_t fill_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fill fills[FILL_MAX];
+
+void proxy_init(void (*done)(void))
+{
+    conn_done = done;
+
+    if (PREFETCH) {
+        prefetch_init(prefetch_fetch);
+        sched_on_idle(prefetch_pump);  // queued prefetches go once the rush is over
+    }
+}
+
+void proxy_fill(const char *url)
+{
+    fill_start(url, 0);
+}
+
+static int prefetch_fetch(const char *url)
+{
+    return fill_start(url, 1);
+}
+
+static int fill_start(const char *url, int prefetch)
+{
+    struct fill *slot = NULL;
+    char copy[SHORTMAX], hostname[SHORTMAX] = {0}, rest[SHORTMAX] = {0};
+    int i, busy = 0;
+    int max = sched_slots();
+
+    if (max <= 0 || max > FILL_MAX) max = FILL_MAX;  // no sched with coroutines, they hold no worker
+
+    snprintf(copy, sizeof(copy), "%s", url);
+    if (parse_url(copy, hostname, rest)) return 1;
+
+    pthread_mutex_lock(&fill_mutex);
+    for (i = 0; i < FILL_MAX; i++) {
+        if (!strcmp(fills[i].url, url)) {
+            pthread_mutex_unlock(&fill_mutex);
+            return 1;   // already on its way
+        }
+        if (fills[i].url[0] != '\0')
+            busy++;
+        else if (slot == NULL)
+            slot = &fills[i];
+    }
+    if (busy >= max) slot = NULL;
+    if (slot != NULL) {
+        snprintf(slot->url, SHORTMAX, "%s", url);
+        slot->prefetch = prefetch;
+    }
+    pthread_mutex_unlock(&fill_mutex);
+
+    if (slot == NULL) return -1;   // too many fills
+
+    fprintf(stderr, "cache: %s %s in the background\n", prefetch ? "prefetching" : "filling", url);
+    if ((coro_active() ? coro_spawn(fill_job, slot) : sched_submit(hostname, fill_job, slot)) != 0) {
+        pthread_mutex_lock(&fill_mutex);
+        slot->url[0] = '\0';
+        pthread_mutex_unlock(&fill_mutex);
+        return -1;
+    }
+    return 0;
+}
+
+static void fill_job(void *arg)
+{
+    struct fill *slot = arg;
+    struct cache_obj *obj;
+    size_t stored = 0;
+    char url[SHORTMAX], hostname[SHORTMAX] = {0}, rest[SHORTMAX] = {0};
+    char buf[LONGMAX], response_header[LONGMAX] = {0};
+    char *port = "80", *colon;
+    long response_length = -1;
+    int response_chunked = 0, status = 0;
+    int sockfd = -1, rc, n;
+    char *relay_buf = NULL;
+    struct body_copy copy = { .data = NULL };
+    struct rio_t rio;
+    struct backend *backend = NULL;
+    int backend_result = 0;
+
+    strcpy(url, slot->url);
+    copy.throttle = slot->prefetch;
+    if (parse_url(url, hostname, rest)) goto done;
+
+    n = sprintf(buf, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", rest, hostname);
+
+    colon = strrchr(hostname, ':');
+    if (rproxy_enabled()) {
+        if ((backend = rproxy_route(hostname, rest, NULL)) == NULL) goto done;
+        snprintf(hostname, SHORTMAX, "%s", backend->host);
+        port = backend->port;
+    } else if (colon != NULL && hostname[0] != '[') {
+        *colon = '\0';
+        port = colon + 1;
+    }
+    backend_result = -1;
+    if ((sockfd = upstream_connect(hostname, port)) == -1) goto done;
+    if (rio_writen(sockfd, buf, n) == -1) goto done;
+
+    rio_readinitb(&rio, sockfd);
+    if (rio_readlineb(&rio, buf, LONGMAX) <= 0) goto done;
+    sscanf(buf, "%*s %d", &status);
+    strcat(response_header, buf);
+    backend_result = status >= 500 ? -1 : 1;
+    while ((rc = rio_readlineb(&rio, buf, LONGMAX)) > 0 && strcmp(buf, "\r\n")) {
+        if (!strncasecmp(buf, "Content-length:", 15))
+            response_length = atol(buf + 15);
+        else if (!strncasecmp(buf, "Transfer-Encoding:", 18) && strcasestr(buf + 18, "chunked"))
+            response_chunked = 1;
+        if (strlen(response_header) + rc + 3 > LONGMAX) goto done;
+        strcat(response_header, buf);
+    }
+    if (rc <= 0) goto done;
+    strcat(response_header, "\r\n");
+    if (response_chunked) response_length = -1;
+
+    if (status != 200 || !cache_storable(response_header)) goto done;
+
+    relay_buf = (char *) malloc(RELAYMAX);
+    if (response_length > 0) {
+        copy.cap = response_length;
+        copy.data = (char *) malloc(copy.cap);
+    }
+    if (relay_buf != NULL &&
+        relay_body(&rio, -1, NULL, 0, response_length, response_chunked, 0, &copy, NULL, relay_buf, RELAYMAX) >= 0 &&
+        !copy.failed) {
+        obj = cache_insert(url, response_header, copy.data, copy.len);
+        if (obj != NULL && slot->prefetch)
+            atomic_store(&obj->prefetched, 1);
+        cache_release(obj);
+        fprintf(stderr, "cache: filled %s (%zu bytes)\n", url, copy.len);
+        stored = copy.len;
+        copy.data = NULL;
+    }
+
+done:
+    free(copy.data);
+    free(relay_buf);
+    if (sockfd != -1) close(sockfd);
+    rproxy_done(backend, backend_result);
+
+    int prefetch = slot->prefetch;
+    pthread_mutex_lock(&fill_mutex);
+    slot->url[0] = '\0';
+    pthread_mutex_unlock(&fill_mutex);
+    if (prefetch)
+        prefetch_done(stored);
+    else if (PREFETCH)
+        prefetch_pump();  // a queued prefetch may have been waiting for the slot
+}
+
+static void proxy_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+{
+    proxy_error_hdr(fd, cause, errnum, shortmsg, longmsg, "");
+}
+
+static void proxy_error_hdr(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, char *extra)
+{
+    char page[LONGMAX * 2];
+    int n = error_page(page, cause, errnum, shortmsg, longmsg, extra);
+
+    rio_writen(fd, page, n);
 }
 
-void proxy_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+static int error_page(char *dst, char *cause, char *errnum, char *shortmsg, char *longmsg, char *extra)
+/* the whole response, header and body, into dst of LONGMAX * 2 bytes; its length */
 {
     char header[LONGMAX], body[LONGMAX];
 
@@ -236,11 +1083,185 @@ void proxy_error(int fd, char *cause, char *errnum, char *shortmsg, char *longms
     sprintf(header, 
         "HTTP/1.0 %s %s\r\n"
         "Connection: close\r\n"
+        "%s"
         "Content-length: %d\r\n\r\n",
-        errnum, shortmsg, (int) strlen(body));
-    
-    rio_writen(fd, header, strlen(header));
-    rio_writen(fd, body, strlen(body));
+        errnum, shortmsg, extra, (int) strlen(body));
+
+    return sprintf(dst, "%s%s", header, body);
+}
+
+/*
+ * Body relay
+ *
+ * A body is moved through a fixed buffer as it arrives. A message head
+ * waiting to be sent goes out together with the first piece of body in
+ * a single writev.
+ */
+
+struct relay_out {
+    int     fd;
+    char   *head;       // not yet sent, NULL once it has been
+    size_t  headlen;
+    int     dechunk;    // chunk data is what gets sent, not the raw input
+    struct body_copy *copy;  // collects the (decoded) body too, may be NULL
+    struct relay_gzip *gz;   // compresses what gets sent, may be NULL
+};
+
+static int relay_gzip_out(void *ctx, const char *data, size_t n);
+
+static void body_copy_add(struct body_copy *copy, const char *data, size_t n)
+{
+    if (copy == NULL || n == 0) return;
+    if (copy->scan != NULL)
+        prefetch_scan(copy->scan, data, n);
+    if (copy->throttle)
+        prefetch_charge(n);
+    if (copy->failed) return;
+
+    if (copy->len + n > CACHE_OBJMAX) {
+        copy->failed = 1;
+        return;
+    }
+    if (copy->len + n > copy->cap) {
+        size_t cap = copy->cap ? copy->cap * 2 : RELAYMAX;
+        while (cap < copy->len + n) cap *= 2;
+        char *data = realloc(copy->data, cap);
+        if (data == NULL) {
+            copy->failed = 1;
+            return;
+        }
+        copy->data = data;
+        copy->cap  = cap;
+    }
+
+    memcpy(copy->data + copy->len, data, n);
+    copy->len += n;
+}
+
+static int relay_write(struct relay_out *out, const char *data, size_t n)
+{
+    if (out->fd == -1) return 0;  // nobody waiting, only the copy is wanted
+
+    if (out->head != NULL && !(ZEROCOPY && n >= ZEROCOPY_MIN)) {
+        struct iovec iov[2] = {
+            { out->head, out->headlen },
+            { (char *) data, n },
+        };
+        out->head = NULL;
+        return rio_writevn(out->fd, iov, 2) == -1 ? -1 : 0;
+    }
+
+    if (out->head != NULL) {
+        if (rio_writen(out->fd, out->head, out->headlen) == -1) return -1;
+        out->head = NULL;
+    }
+    if (n == 0) return 0;
+
+    if (ZEROCOPY && n >= ZEROCOPY_MIN)
+        return rio_sendzc(out->fd, (char *) data, n) == -1 ? -1 : 0;
+    return rio_writen(out->fd, (char *) data, n) == -1 ? -1 : 0;
+}
+
+static int relay_data(struct relay_out *out, const char *data, size_t n)
+/* body data as the client is to see it, compressed first if we compress */
+{
+    if (out->gz == NULL)
+        return relay_write(out, data, n);
+    return gzip_feed(&out->gz->enc, data, n, 0, relay_gzip_out, out);
+}
+
+static int relay_chunk_data(void *ctx, const char *data, size_t n)
+/* chunked_decode hands us decoded data, to keep and/or to send if we de-chunk */
+{
+    struct relay_out *out = ctx;
+
+    body_copy_add(out->copy, data, n);
+    return out->dechunk ? relay_data(out, data, n) : 0;
+}
+
+static int relay_gzip_out(void *ctx, const char *data, size_t n)
+/* gzip_feed hands us compressed data, to send as it is or as a chunk */
+{
+    struct relay_out *out = ctx;
+    char framed[CHUNK_HDRMAX + GZIP_OUTMAX + 2];
+    size_t len;
+
+    body_copy_add(out->gz->copy, data, n);
+    if (!out->gz->chunked)
+        return relay_write(out, data, n);
+
+    len = chunked_header(framed, n);
+    memcpy(framed + len, data, n);
+    len += n;
+    memcpy(framed + len, CHUNK_CRLF, 2);
+    return relay_write(out, framed, len + 2);
+}
+
+static long relay_body(struct rio_t *from, int to, char *head, size_t headlen,
+                       long length, int chunked, int dechunk, struct body_copy *copy,
+                       struct relay_gzip *gz, char *buf, size_t bufsize)
+/*
+ * copy a message body from one side to the other, with head (if any) in
+ * front of it, and into copy (if any) without transfer coding. The body is
+ *     chunked: passed through as is, or decoded if dechunk or gz is set
+ *     length >= 0: exactly length bytes
+ *     otherwise: everything up to EOF
+ * With gz, what is sent is the decoded body compressed, in chunks if the
+ * client speaks HTTP/1.1 and up to EOF if not.
+ * returns the number of body bytes taken from the sender, or -1
+ */
+{
+    struct relay_out out = { to, head, headlen, dechunk || gz != NULL, copy, gz };
+    struct chunked cp;
+    long total = 0;
+    ssize_t n, used;
+
+    chunked_init(&cp);
+
+    for (;;) {
+        if (!chunked && length >= 0 && total >= length) break;
+
+        if (!chunked && length >= 0 && length - total <= (long) bufsize) {
+            /* all that is left fits, wait for it and send it in one go */
+            n = rio_readnb(from, buf, length - total);
+        } else {
+            n = rio_readb(from, buf, bufsize);
+        }
+        if (n < 0) return -1;
+        if (n == 0) {
+            if (chunked || length >= 0) {
+                fprintf(stderr, "relay_body: body truncated after %ld bytes\n", total);
+                relay_write(&out, NULL, 0);
+                return -1;
+            }
+            break;  // EOF marks the end
+        }
+
+        if (chunked) {
+            used = chunked_decode(&cp, buf, n, out.dechunk || copy ? relay_chunk_data : NULL, &out);
+            if (used < 0) {
+                fprintf(stderr, "relay_body: malformed chunked body\n");
+                return -1;
+            }
+            if (!out.dechunk && relay_write(&out, buf, used) == -1) return -1;
+            total += used;
+            if (cp.done) break;
+        } else {
+            if (relay_data(&out, buf, n) == -1) return -1;
+            body_copy_add(copy, buf, n);
+            total += n;
+        }
+    }
+
+    if (gz != NULL) {  // what deflate still holds, and the end of the chunks
+        if (gzip_feed(&gz->enc, NULL, 0, 1, relay_gzip_out, &out) == -1) return -1;
+        if (gz->chunked && relay_write(&out, CHUNK_LAST, strlen(CHUNK_LAST)) == -1) return -1;
+    }
+
+    if (relay_write(&out, NULL, 0) == -1)  // a head with no body still has to go
+        return -1;
+
+    return total;
 }
 
 static int parse_url(char *url, char *hostname, char *rest)
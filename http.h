@@ -1,6 +1,31 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+/*
+ * done is called whenever proxy_connect is through with a client
+ * connection, which may be after proxy_connect has returned; call once
+ * before any connection is served
+ */
+void proxy_init(void (*done)(void));
+
+/*
+ * read a request from fd and answer it, from the cache or from the
+ * origin, then close fd. Outside a coroutine the origin is contacted
+ * from a job queued with sched_submit, sched_init must have been called
+ */
 void proxy_connect(int fd);
 
+/*
+ * fetch url into the cache in the background, unless it is already
+ * being fetched; used to turn a ranged miss into later hits
+ */
+void proxy_fill(const char *url);
+
+/*
+ * answer a client we have no capacity for with a 503 and a Retry-After
+ * hint, without reading its request or touching any remote server, and
+ * without ever waiting on fd: safe to call from the event loop
+ */
+void proxy_busy(int fd, int retry_after);
+
 #endif
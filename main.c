@@ -1,24 +1,124 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <signal.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/wait.h>
 
 #include "utils.h"
+#include "cache.h"
 #include "tpool.h"
 #include "http.h"
+#include "coro.h"
+#include "sched.h"
+#include "rproxy.h"
+#include "prefetch.h"
+#include "probes.h"
+#include "gzip.h"
 
 #define PORT "3333"
 #define SHORTMAX 512
 #define LONGMAX  8192
 #define MAXEVENT 1024
 
+/*
+ * Admission control
+ *
+ * MAX_CONNS caps the number of client connections we hold at once; once
+ * it is reached the listening socket is taken out of epoll and new
+ * connections wait in the kernel backlog until we drop below
+ * RESUME_CONNS. MAX_QUEUE caps the tpool job queue; requests that would
+ * queue behind it are refused with a 503 straight from the event loop.
+ */
+#define MAX_CONNS    1024
+#define RESUME_CONNS (MAX_CONNS * 9 / 10)
+#define MAX_QUEUE    64
+#define RETRY_AFTER  1    /* seconds, sent to clients we turn away */
+
+/*
+ * Worker placement
+ *
+ * WORKER_CPUS is either empty (let the scheduler place workers), "each"
+ * (one pinned worker per CPU we may run on, WORKERS is ignored) or a list such
+ * as "0-3,8-11" that WORKERS are pinned to round-robin. On a multi-socket
+ * host, listing the cores of the socket the NIC is attached to keeps
+ * workers, their stacks and their buffers on that node.
+ */
+#define WORKERS      4
+#define WORKER_CPUS  ""
+#define WORKER_LOCAL (256 * 1024)   /* per-worker buffer, see tpool_local */
+#define CPU_SETSIZE_MAX 1024
+
+/*
+ * Execution model
+ *
+ * With CORO_MODE 0 every request occupies a worker from the moment it is
+ * read until the response is sent. With CORO_MODE 1 every worker runs a
+ * coroutine scheduler instead, each connection becomes a coroutine, and
+ * a coroutine waiting on a socket gives its worker to the others. The
+ * main thread accepts connections itself, as all workers are taken, and
+ * MAX_QUEUE does not apply since nothing queues in tpool.
+ */
+#define CORO_MODE    0
+
+/*
+ * Per-origin scheduling
+ *
+ * With CORO_MODE 0, a request is read and parsed by any worker, but the
+ * part that waits on the origin is queued per origin and started by
+ * sched. sched never runs more than all but SCHED_RESERVE workers, and
+ * reading a request is queued ahead of everything else, so a new request
+ * is picked up by the next free worker rather than waiting behind origin
+ * work; no origin holds more than its share of sched's. kill -USR1 prints
+ * each origin's queue depth and queueing delay to stderr.
+ */
+#define SCHED_RESERVE 1
+
+/*
+ * Listener tuning
+ *
+ * BACKLOG is passed to listen(), the kernel still caps it at
+ * net.core.somaxconn. DEFER_ACCEPT (seconds, 0 to disable) keeps a
+ * connection in the kernel until its first request bytes arrive, so
+ * neither accept nor epoll wake us for clients that have sent nothing.
+ * FASTOPEN_QLEN (0 to disable) enables server-side TCP Fast Open, which
+ * lets a returning client put its request in the SYN.
+ */
+#define BACKLOG       4096
+#define DEFER_ACCEPT  5
+#define FASTOPEN_QLEN 256
+
+/*
+ * Restarts
+ *
+ * kill -USR2 starts the binary again under the same name and arguments
+ * and passes it the listening socket over a Unix socket, so connections
+ * keep queueing in the same backlog throughout, and a snapshot of the
+ * cache, so it starts warm. Once the new process is ready the old one
+ * stops accepting, finishes the connections it holds, for at most
+ * DRAIN_TIMEOUT seconds, and exits. If the new process is not ready
+ * within HANDOFF_TIMEOUT seconds it is killed and the old one carries on.
+ */
+#define HANDOFF_ENV     "PARROTS_HANDOFF"   /* the new process's end of the Unix socket */
+#define HANDOFF_TIMEOUT 30
+#define DRAIN_TIMEOUT   30
+
 /*
  * Currently this proxy server supports HTTP only, or
  * more precisely the GET method for HTTP/1.x.
@@ -30,12 +130,35 @@
  */
 
 static void request_handler(void *arg);
+static void client_handler(void *arg);
 static int  setup_listenfd();
+static void pause_accept();
+static void resume_accept();
+static void conn_release();
+static int  parse_cpus(const char *spec, int *cpus, int max);
+static void report_handler(int sig);
+static void restart_handler(int sig);
+static void restart();
+static void *handoff(void *arg);
+static void handoff_done();
+static void stop_accept();
 
 int listenfd;
 int epfd;
 
-int main()
+static atomic_int      conn_cnt;        // client connections currently held
+static atomic_int      accept_paused;   // listenfd removed from epoll
+static pthread_mutex_t accept_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t report_pending;  // SIGUSR1 arrived
+static volatile sig_atomic_t restart_pending; // SIGUSR2 arrived
+static atomic_int      restarting;      // a handoff is under way or done
+static atomic_int      draining;        // handed over, finishing what we hold
+static time_t          drain_deadline;
+static int             handoff_fd = -1; // set while we are the new process
+static char          **args;
+static char            exe[PATH_MAX];   // our binary, for the next process to run
+
+int main(int argc, char **argv)
 {
     /*
      * according to
@@ -44,14 +167,62 @@ int main()
      * to suppress SIGPIPE error
      */
     signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, report_handler);
+    signal(SIGUSR2, restart_handler);
+    args = argv;
+    /*
+     * the path, resolved now: argv[0] may be relative or found by PATH, and
+     * exec'ing /proc/self/exe later would start this binary even if it has
+     * been rebuilt since
+     */
+    if (realpath("/proc/self/exe", exe) == NULL) {
+        perror("/proc/self/exe");
+        exe[0] = '\0';
+    }
+
+    /* -r file: reverse proxy for the backends and routes listed in file */
+    int opt;
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt == 'r' && rproxy_load(optarg) == 0) continue;
+        fprintf(stderr, "usage: %s [-r config]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
     listenfd = setup_listenfd();
-    set_nonblock(listenfd);
 
-    tpool_t *tpool = tpool_create(4);
+    static int cpus[CPU_SETSIZE_MAX];
+    tpool_attr_t attr = { cpus, 0, WORKER_LOCAL };
+    int workers = WORKERS;
+
+    if (!strcmp(WORKER_CPUS, "each")) {
+        attr.cpu_cnt = TPOOL_CPU_EACH;
+        workers = 0;
+    } else {
+        attr.cpu_cnt = parse_cpus(WORKER_CPUS, cpus, CPU_SETSIZE_MAX);
+    }
+
+    /* workers inherit the mask, so SIGUSR1 and SIGUSR2 interrupt the epoll_wait below */
+    sigset_t usr;
+    sigemptyset(&usr);
+    sigaddset(&usr, SIGUSR1);
+    sigaddset(&usr, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &usr, NULL);
+    tpool_t *tpool = tpool_create_attr(workers, &attr);
     perror("pool create");
+    pthread_sigmask(SIG_UNBLOCK, &usr, NULL);
+    proxy_init(conn_release);
+
+    if (!CORO_MODE) {
+        int slots = (int) tpool->thread_cnt - SCHED_RESERVE;
+        sched_init(tpool, slots > 0 ? slots : 1);
+    }
+
+    if (CORO_MODE && coro_start(tpool, (int) tpool->thread_cnt) == -1) {
+        fprintf(stderr, "failed to start coroutine schedulers\n");
+        exit(EXIT_FAILURE);
+    }
 
-    epfd = epoll_create1(0);
+    epfd = epoll_create1(EPOLL_CLOEXEC);  // or every restart's successor inherits it
     if (epfd == -1) {
         perror("epoll_create1");
         exit(EXIT_FAILURE);
@@ -67,10 +238,34 @@ int main()
     struct epoll_event * events;
     events = (struct epoll_event *) malloc(sizeof(struct epoll_event) * MAXEVENT);
 
+    if (handoff_fd != -1)
+        handoff_done();
+
     fprintf(stderr, "proxy server started\n");
 
     while (1) {
-        int ready_fds = epoll_wait(epfd, events, MAXEVENT, -1);
+        /* while restarting, wake up now and then to see whether draining is over */
+        int ready_fds = epoll_wait(epfd, events, MAXEVENT, atomic_load(&restarting) ? 1000 : -1);
+
+        if (report_pending) {  // interrupted epoll_wait, ready_fds is -1
+            report_pending = 0;
+            sched_report(stderr);
+            rproxy_report(stderr);
+            prefetch_report(stderr);
+            gzip_report(stderr);
+        }
+
+        if (restart_pending) {
+            restart_pending = 0;
+            restart();
+        }
+
+        if (atomic_load(&draining) &&
+            (atomic_load(&conn_cnt) == 0 || time(NULL) >= drain_deadline)) {
+            /* workers may still be busy past the deadline, do not wait for them */
+            fprintf(stderr, "restart: %d connections left, exiting\n", atomic_load(&conn_cnt));
+            exit(EXIT_SUCCESS);
+        }
 
         int i;
         for (i = 0; i < ready_fds; ++i) {
@@ -79,10 +274,29 @@ int main()
                 (!(events[i].events & EPOLLIN))) {
                 fprintf(stderr, "epoll_wait: unexpected event detected, closing affected fd\n");
                 close(events[i].data.fd);
+                if (events[i].data.fd != listenfd)
+                    conn_release();
+                continue;
+            }
+
+            int fd = events[i].data.fd;
+
+            if (CORO_MODE) {
+                /* only the listenfd is ours, connections live in their schedulers */
+                request_handler((void *) (intptr_t) fd);
+                continue;
+            }
+
+            if (fd != listenfd && tpool_job_cnt(tpool) >= MAX_QUEUE) {
+                /* no worker would get to it in time, refuse it quickly instead */
+                proxy_busy(fd, RETRY_AFTER);
+                close(fd);
+                conn_release();
                 continue;
             }
 
-            tpool_add_job(tpool, request_handler, &events[i].data.fd);
+            /* events gets overwritten by the next epoll_wait, pass the fd itself */
+            tpool_add_job_urgent(tpool, request_handler, (void *) (intptr_t) fd);
         }
     }
 
@@ -96,42 +310,71 @@ static void request_handler(void *arg)
 {
     signal(SIGPIPE, SIG_IGN);
 
+#ifdef DE_BUG
     char s[INET6_ADDRSTRLEN] = {0};
+#endif
     int cli_fd;
     struct sockaddr_storage cli_addr;
     socklen_t sin_size = sizeof(cli_addr);
 
     struct epoll_event ev;
 
-    int fd = * (int *) arg;
+    int fd = (int) (intptr_t) arg;
 
     if (fd == listenfd) { // first time connection with the socket
         for (;;) {
-            cli_fd = accept(fd, (struct sockaddr *) &cli_addr, &sin_size);
+            if (atomic_load(&draining)) break;  // the backlog is the new process's now
+
+            if (atomic_load(&conn_cnt) >= MAX_CONNS) {
+                /* leave the rest in the backlog until some connections finish */
+                pause_accept();
+                break;
+            }
+
+            /* one syscall instead of accept + two fcntl for set_nonblock */
+            sin_size = sizeof(cli_addr);
+            cli_fd = accept4(fd, (struct sockaddr *) &cli_addr, &sin_size,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
             if (cli_fd == -1) {
                 if ((errno == EAGAIN) ||
                     (errno == EWOULDBLOCK)) { // has handled all requests
                     break;
+                } else if (errno == EINTR || errno == ECONNABORTED) {
+                    continue; // the rest of the backlog is still waiting
                 } else {
-                    fprintf(stderr, "accept");
+                    perror("accept4");
                     break; // see man accept for more errors
                 }
             }
 
+            atomic_fetch_add(&conn_cnt, 1);
+            PROBE1(accept, cli_fd);
+
+#ifdef DE_BUG
             inet_ntop(cli_addr.ss_family, get_in_addr((struct sockaddr *) &cli_addr), s, sizeof(s));
             fprintf(stderr, "client %s\n", s);
+#endif
 
-            set_nonblock(cli_fd);
+            if (CORO_MODE) {
+                /* its reads park the coroutine until the request arrives */
+                if (coro_spawn(client_handler, (void *) (intptr_t) cli_fd) == -1) {
+                    close(cli_fd);
+                    conn_release();
+                }
+                continue;
+            }
 
             ev.data.fd = cli_fd;
             ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
 
             if (epoll_ctl(epfd, EPOLL_CTL_ADD, cli_fd, &ev) == -1) {
                 perror("EPOLL_CTL_ADD");
+                close(cli_fd);
+                conn_release();
             }
         }
     } else { // alive connections
-        proxy_connect(fd);
+        client_handler(arg);
         /*
          * TODO
          * when errors occur, proxy_connect simply returns and 
@@ -141,6 +384,13 @@ static void request_handler(void *arg)
     }
 }
 
+static void client_handler(void *arg)
+{
+    int fd = (int) (intptr_t) arg;
+
+    proxy_connect(fd);  // calls conn_release once the connection is done with
+}
+
 static int setup_listenfd()
 {
     struct addrinfo hints, *servinfo, *servinfo_list;
@@ -152,6 +402,18 @@ static int setup_listenfd()
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
+    /* restarted by the previous process, which is still listening for us */
+    char *handoff = getenv(HANDOFF_ENV);
+    if (handoff != NULL) {
+        handoff_fd = atoi(handoff);
+        unsetenv(HANDOFF_ENV);  // not for the process we may start in turn
+        if ((sockfd = recv_fd(handoff_fd)) != -1)
+            return sockfd;
+        fprintf(stderr, "restart: no listening socket handed over\n");
+        close(handoff_fd);
+        handoff_fd = -1;
+    }
+
     int err;
     if ((err = getaddrinfo(NULL, PORT, &hints, &servinfo_list))) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
@@ -159,7 +421,8 @@ static int setup_listenfd()
     }
 
     for (servinfo = servinfo_list; servinfo != NULL; servinfo = servinfo->ai_next) {
-        if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) == -1) {
+        if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                             servinfo->ai_protocol)) == -1) {
             perror("socket");
             continue;
         }
@@ -183,7 +446,18 @@ static int setup_listenfd()
         exit(EXIT_FAILURE);
     }
 
-    if (listen(sockfd, SOMAXCONN) == -1) {
+    /* both are optimizations only, carry on without them if unsupported */
+    int opt;
+    if ((opt = DEFER_ACCEPT) > 0 &&
+        setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(int)) == -1) {
+        perror("setsockopt TCP_DEFER_ACCEPT");
+    }
+    if ((opt = FASTOPEN_QLEN) > 0 &&
+        setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(int)) == -1) {
+        perror("setsockopt TCP_FASTOPEN");
+    }
+
+    if (listen(sockfd, BACKLOG) == -1) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
@@ -192,3 +466,210 @@ static int setup_listenfd()
 
     return sockfd;
 }
+
+static void pause_accept()
+{
+    pthread_mutex_lock(&accept_mutex);
+    if (!accept_paused) {
+        if (epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL) == -1) {
+            perror("EPOLL_CTL_DEL");
+        } else {
+            accept_paused = 1;
+            fprintf(stderr, "admission: %d connections, accept paused\n", atomic_load(&conn_cnt));
+        }
+    }
+    pthread_mutex_unlock(&accept_mutex);
+
+    /* everything may have finished while we were deciding to pause */
+    if (atomic_load(&conn_cnt) < RESUME_CONNS)
+        resume_accept();
+}
+
+static void resume_accept()
+{
+    struct epoll_event ev;
+
+    pthread_mutex_lock(&accept_mutex);
+    if (accept_paused && !draining) {
+        /* re-adding reports the listenfd ready if the backlog is not empty */
+        ev.data.fd = listenfd;
+        ev.events = EPOLLIN | EPOLLET;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+            perror("EPOLL_CTL_ADD");
+        } else {
+            accept_paused = 0;
+            fprintf(stderr, "admission: accept resumed\n");
+        }
+    }
+    pthread_mutex_unlock(&accept_mutex);
+}
+
+static void conn_release()
+/* a client connection has been closed */
+{
+    if (atomic_fetch_sub(&conn_cnt, 1) - 1 < RESUME_CONNS && atomic_load(&accept_paused))
+        resume_accept();
+}
+
+static int parse_cpus(const char *spec, int *cpus, int max)
+/* "0-3,8" -> {0, 1, 2, 3, 8}, returns the number of CPUs listed */
+{
+    int cnt = 0;
+    int lo, hi;
+    char *end;
+
+    while (*spec != '\0' && cnt < max) {
+        lo = hi = (int) strtol(spec, &end, 10);
+        if (end == spec) break;
+        if (*end == '-') {
+            spec = end + 1;
+            hi = (int) strtol(spec, &end, 10);
+            if (end == spec) break;
+        }
+        for (; lo <= hi && cnt < max; ++lo)
+            cpus[cnt++] = lo;
+
+        spec = end;
+        if (*spec == ',') spec++;
+    }
+
+    return cnt;
+}
+
+static void report_handler(int sig)
+{
+    (void) sig;
+    report_pending = 1;
+}
+
+static void restart_handler(int sig)
+{
+    (void) sig;
+    restart_pending = 1;
+}
+
+static void restart()
+{
+    pthread_t tid;
+
+    if (atomic_exchange(&restarting, 1)) return;  // one at a time
+    if (exe[0] == '\0') {
+        fprintf(stderr, "restart: do not know our own binary\n");
+        atomic_store(&restarting, 0);
+        return;
+    }
+
+    /* the snapshot may take a while to write, keep the event loop going meanwhile */
+    if (pthread_create(&tid, NULL, handoff, NULL) != 0) {
+        perror("pthread_create");
+        atomic_store(&restarting, 0);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static void *handoff(void *arg)
+/* start the new process, give it listenfd and the cache, stop accepting once it is ready */
+{
+    extern char **environ;
+    char env[32];
+    char **envp;
+    char ready;
+    int sv[2], n, i, saved;
+    pid_t pid;
+    sigset_t set;
+    struct pollfd pfd;
+
+    (void) arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        atomic_store(&restarting, 0);
+        return NULL;
+    }
+
+    /* built before fork, the child may only make async-signal-safe calls */
+    for (n = 0; environ[n] != NULL; ++n) ;
+    envp = (char **) malloc(sizeof(char *) * (n + 2));
+    for (i = 0; i < n; ++i) envp[i] = environ[i];
+    snprintf(env, sizeof(env), HANDOFF_ENV "=%d", sv[1]);
+    envp[n] = env;
+    envp[n + 1] = NULL;
+    sigemptyset(&set);
+
+    pid = fork();
+    if (pid == 0) {
+        fcntl(sv[1], F_SETFD, 0);  // the one descriptor the new process keeps
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        execve(exe, args, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        atomic_store(&restarting, 0);
+        return NULL;
+    }
+
+    fprintf(stderr, "restart: started %d\n", (int) pid);
+
+    if (send_fd(sv[0], listenfd) == -1)
+        goto failed;
+    /* may fail with the new process already serving, if it gave up on the snapshot */
+    if ((saved = cache_save(sv[0])) == -1)
+        shutdown(sv[0], SHUT_WR);  // so it sees the snapshot end rather than wait for the rest
+
+    /* one byte once it has the socket and is about to accept, EOF if it failed */
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, HANDOFF_TIMEOUT * 1000) != 1 || read(sv[0], &ready, 1) != 1)
+        goto failed;
+    close(sv[0]);
+
+    fprintf(stderr, "restart: handed over to %d with %d cached objects, draining %d connections\n",
+            (int) pid, saved > 0 ? saved : 0, atomic_load(&conn_cnt));
+    drain_deadline = time(NULL) + DRAIN_TIMEOUT;
+    stop_accept();
+    return NULL;
+
+failed:
+    fprintf(stderr, "restart: %d did not take over, carrying on\n", (int) pid);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(sv[0]);
+    atomic_store(&restarting, 0);
+    return NULL;
+}
+
+static void handoff_done()
+/* the new process: take the cache snapshot and tell the old process we are ready */
+{
+    int n = cache_load(handoff_fd);
+
+    if (n == -1)
+        fprintf(stderr, "restart: cache snapshot incomplete\n");
+    else
+        fprintf(stderr, "restart: took over the listening socket and %d cached objects\n", n);
+
+    if (write(handoff_fd, "r", 1) != 1)
+        perror("restart: write");
+    close(handoff_fd);
+    handoff_fd = -1;
+}
+
+static void stop_accept()
+/* for good, unlike pause_accept */
+{
+    pthread_mutex_lock(&accept_mutex);
+    if (!accept_paused && epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL) == -1)
+        perror("EPOLL_CTL_DEL");
+    accept_paused = 1;
+    atomic_store(&draining, 1);
+    pthread_mutex_unlock(&accept_mutex);
+}
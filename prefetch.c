@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "prefetch.h"
+#include "cache.h"
+#include "coro.h"
+#include "sched.h"
+
+#define PREFETCH_MAX    2                /* prefetches running at once */
+#define PREFETCH_QUEUE  64               /* waiting to start, more are dropped */
+#define PREFETCH_LINKS  32               /* taken from one page at most */
+#define PREFETCH_RATE   (256 * 1024)     /* bytes per second, all prefetches together */
+#define PREFETCH_BURST  (64 * 1024)
+
+enum { SCAN, NAME, EQUALS, VALUE, SKIP };
+
+static int  (*fetch)(const char *url);
+static char     queue[PREFETCH_QUEUE][PREFETCH_URLMAX];
+static int      queue_head;
+static int      queue_cnt;
+static int      running;
+static long     tokens = PREFETCH_BURST;
+static long     refilled;               // ms, when tokens were last topped up
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long     stat_queued, stat_dropped, stat_fetched, stat_bytes, stat_hits;
+
+static void push(struct link_scan *ls, char c);
+static void found(struct link_scan *ls);
+static int  resolve(struct link_scan *ls, char *url);
+static void want(const char *url);
+static void refill();
+static long now_ms();
+
+void prefetch_init(int (*func)(const char *url))
+{
+    fetch = func;
+}
+
+void prefetch_page(struct link_scan *ls, const char *url)
+{
+    const char *p;
+
+    memset(ls, 0, sizeof(*ls));
+    memset(ls->win, ' ', sizeof(ls->win) - 1);
+    snprintf(ls->page, sizeof(ls->page), "%s", url);
+
+    /* "http://host[:port]", the rest of the url is the path */
+    p = strchr(ls->page + 7, '/');
+    ls->origin_len = p != NULL ? (size_t) (p - ls->page) : strlen(ls->page);
+}
+
+void prefetch_scan(struct link_scan *ls, const char *data, size_t n)
+/*
+ * a character at a time, looking for ' src' or ' href', then '=' and
+ * a value, quoted or not; no state is kept but what is in ls
+ */
+{
+    size_t i;
+    char c;
+    int end;
+
+    for (i = 0; i < n && ls->links < PREFETCH_LINKS; i++) {
+        c = data[i];
+
+        switch (ls->state) {
+        case NAME:
+            if (isspace((unsigned char) c)) break;
+            if (c == '=') {
+                ls->state = EQUALS;
+                break;
+            }
+            ls->state = SCAN;
+            /* fall through */
+        case SCAN:
+            push(ls, c);
+            if ((!memcmp(ls->win + 2, "src", 3) && isspace((unsigned char) ls->win[1])) ||
+                (!memcmp(ls->win + 1, "href", 4) && isspace((unsigned char) ls->win[0])))
+                ls->state = NAME;
+            break;
+        case EQUALS:
+            if (isspace((unsigned char) c)) break;
+            if (c == '>') {
+                ls->state = SCAN;
+                break;
+            }
+            ls->len = 0;
+            ls->state = VALUE;
+            if (c == '"' || c == '\'') {
+                ls->quote = c;
+                break;
+            }
+            ls->quote = 0;
+            /* fall through */
+        case VALUE:
+        case SKIP:
+            end = ls->quote ? c == ls->quote : isspace((unsigned char) c) || c == '>';
+            if (!end) {
+                if (ls->len + 1 < sizeof(ls->val))
+                    ls->val[ls->len++] = c;
+                else
+                    ls->state = SKIP;  // longer than any url we would fetch
+                break;
+            }
+            if (ls->state == VALUE) {
+                ls->val[ls->len] = '\0';
+                found(ls);
+            }
+            ls->state = SCAN;
+            memset(ls->win, 'x', sizeof(ls->win) - 1);
+            if (!ls->quote) push(ls, c);  // may be the space in front of the next one
+            break;
+        }
+    }
+}
+
+void prefetch_charge(size_t n)
+/*
+ * token bucket, refilled at PREFETCH_RATE up to PREFETCH_BURST; a
+ * coroutine waits out the debt, a worker thread is not put to sleep for
+ * it and leaves it to prefetch_pump to start nothing until it is repaid
+ */
+{
+    long wait = 0;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    refill();
+    tokens -= (long) n;
+    if (tokens < 0)
+        wait = -tokens * 1000 / PREFETCH_RATE;
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    if (wait > 0 && coro_active())
+        coro_poll(NULL, 0, (int) wait);
+}
+
+void prefetch_done(size_t bytes)
+{
+    pthread_mutex_lock(&prefetch_mutex);
+    running--;
+    if (bytes > 0) {
+        stat_fetched++;
+        stat_bytes += (long) bytes;
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    prefetch_pump();
+}
+
+void prefetch_hit(void)
+{
+    pthread_mutex_lock(&prefetch_mutex);
+    stat_hits++;
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+void prefetch_pump(void)
+{
+    char url[PREFETCH_URLMAX];
+    int rc;
+
+    for (;;) {
+        pthread_mutex_lock(&prefetch_mutex);
+        /* foreground requests first: start nothing while they are queueing, or while over the bandwidth */
+        refill();
+        if (fetch == NULL || queue_cnt == 0 || running >= PREFETCH_MAX || !sched_idle() || tokens < 0) {
+            pthread_mutex_unlock(&prefetch_mutex);
+            return;
+        }
+        strcpy(url, queue[queue_head]);
+        queue_head = (queue_head + 1) % PREFETCH_QUEUE;
+        queue_cnt--;
+        running++;
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        if ((rc = fetch(url)) == 0) continue;
+
+        pthread_mutex_lock(&prefetch_mutex);
+        running--;
+        if (rc == -1 && queue_cnt < PREFETCH_QUEUE) {
+            /* no room for it yet, it stays first in line and we try again later */
+            queue_head = (queue_head + PREFETCH_QUEUE - 1) % PREFETCH_QUEUE;
+            strcpy(queue[queue_head], url);
+            queue_cnt++;
+        } else {
+            stat_dropped++;
+        }
+        pthread_mutex_unlock(&prefetch_mutex);
+        if (rc == -1) return;
+    }
+}
+
+void prefetch_report(FILE *out)
+{
+    if (fetch == NULL) return;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    fprintf(out, "prefetch: queued %ld dropped %ld fetched %ld (%ld bytes) used %ld, hit rate %ld%%\n",
+            stat_queued, stat_dropped, stat_fetched, stat_bytes, stat_hits,
+            stat_fetched ? stat_hits * 100 / stat_fetched : 0);
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+/*
+ * Static functions
+ */
+
+static void push(struct link_scan *ls, char c)
+{
+    memmove(ls->win, ls->win + 1, sizeof(ls->win) - 2);
+    ls->win[sizeof(ls->win) - 2] = (char) tolower((unsigned char) c);
+}
+
+static void found(struct link_scan *ls)
+{
+    char url[PREFETCH_URLMAX];
+
+    if (resolve(ls, url) == -1) return;
+    ls->links++;
+    want(url);
+}
+
+static int resolve(struct link_scan *ls, char *url)
+/* the absolute url of the reference in ls->val, -1 if it is not one for us */
+{
+    const char *ref = ls->val;
+    const char *page = ls->page;
+    const char *dir;
+    char *hash;
+    int n;
+
+    if (ref[0] == '\0' || ref[0] == '#') return -1;
+    if (strstr(ref, "./") != NULL) return -1;  // dot segments, the client would normalize them first
+
+    if (!strncasecmp(ref, "http://", 7)) {
+        n = snprintf(url, PREFETCH_URLMAX, "%s", ref);
+    } else if (ref[0] == '/' && ref[1] == '/') {
+        n = snprintf(url, PREFETCH_URLMAX, "http:%s", ref);
+    } else if (ref[0] == '/') {
+        n = snprintf(url, PREFETCH_URLMAX, "%.*s%s", (int) ls->origin_len, page, ref);
+    } else if (ref[strcspn(ref, ":/?#")] == ':') {
+        return -1;  // https:, mailto:, javascript:, data: ...
+    } else {
+        dir = strrchr(page + ls->origin_len, '/');
+        if (dir == NULL)
+            n = snprintf(url, PREFETCH_URLMAX, "%s/%s", page, ref);
+        else
+            n = snprintf(url, PREFETCH_URLMAX, "%.*s%s", (int) (dir + 1 - page), page, ref);
+    }
+    if (n >= PREFETCH_URLMAX) return -1;
+
+    if ((hash = strchr(url, '#')) != NULL) *hash = '\0';
+
+    /* same origin only, and not the page itself */
+    if (strncasecmp(url, page, ls->origin_len) ||
+        (url[ls->origin_len] != '\0' && url[ls->origin_len] != '/'))
+        return -1;
+    if (!strcmp(url, page)) return -1;
+
+    return 0;
+}
+
+static void want(const char *url)
+{
+    struct cache_obj *obj;
+    int i;
+
+    if ((obj = cache_lookup(url)) != NULL) {  // nothing to do
+        cache_release(obj);
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch_mutex);
+    for (i = 0; i < queue_cnt; i++) {
+        if (!strcmp(queue[(queue_head + i) % PREFETCH_QUEUE], url)) {
+            pthread_mutex_unlock(&prefetch_mutex);
+            return;
+        }
+    }
+    if (queue_cnt == PREFETCH_QUEUE) {
+        stat_dropped++;
+    } else {
+        strcpy(queue[(queue_head + queue_cnt) % PREFETCH_QUEUE], url);
+        queue_cnt++;
+        stat_queued++;
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    prefetch_pump();
+}
+
+static void refill()
+/* with prefetch_mutex held */
+{
+    long now = now_ms();
+
+    tokens += (now - refilled) * PREFETCH_RATE / 1000;
+    if (tokens > PREFETCH_BURST) tokens = PREFETCH_BURST;
+    refilled = now;
+}
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,101 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define PREFETCH_URLMAX 512
+
+/*
+ * Link prefetching
+ *
+ * While a cacheable HTML page streams through, prefetch_scan picks the
+ * src and href references out of it without allocating. Those on the
+ * page's own origin are queued and fetched into the cache in the
+ * background, a few at a time, only while the workers have capacity to
+ * spare, and no faster than PREFETCH_RATE in total.
+ */
+
+struct link_scan {
+    char    page[PREFETCH_URLMAX];  // absolute url of the page, references are relative to it
+    size_t  origin_len;             // of "http://host[:port]" in page
+    int     state;
+    char    win[6];                 // the last few characters, lowercased
+    char    quote;                  // that the value started with, or 0
+    char    val[PREFETCH_URLMAX];
+    size_t  len;
+    int     links;                  // queued from this page so far
+};
+
+/**
+ * @brief Set up prefetching
+ *
+ * @param   fetch   starts fetching url into the cache in the background and
+ *                  calls prefetch_done when it is through; returns 0, -1
+ *                  if there is no room for it now, or 1 if url will not
+ *                  be fetched
+ * @return  nothing
+ */
+
+void prefetch_init(int (*fetch)(const char *url));
+
+/**
+ * @brief Start scanning the body of the page at url
+ *
+ * @example
+ *
+ *      ..
+ *      struct link_scan ls;
+ *      prefetch_page(&ls, "http://example.com/index.html");
+ *      while ((n = read(fd, buf, sizeof(buf))) > 0)
+ *          prefetch_scan(&ls, buf, n);
+ *      ..
+ */
+
+void prefetch_page(struct link_scan *ls, const char *url);
+
+/**
+ * @brief Feed the next n bytes of the page's body to the scanner
+ *
+ * References may be split across calls.
+ */
+
+void prefetch_scan(struct link_scan *ls, const char *data, size_t n);
+
+/**
+ * @brief Account for n more bytes of a prefetch, waiting if prefetching
+ *        is over its bandwidth and this is a coroutine
+ *
+ * A worker thread never waits here: prefetch_pump starts no prefetch
+ * until what it overspent is paid back.
+ */
+
+void prefetch_charge(size_t n);
+
+/**
+ * @brief A fetch started by prefetch_init's fetch has ended
+ *
+ * @param   bytes   how much it stored in the cache, 0 if nothing
+ */
+
+void prefetch_done(size_t bytes);
+
+/**
+ * @brief A client was answered from a prefetched cache entry
+ */
+
+void prefetch_hit(void);
+
+/**
+ * @brief Start queued prefetches, if there is room for them now
+ */
+
+void prefetch_pump(void);
+
+/**
+ * @brief Print prefetches queued, fetched and used
+ */
+
+void prefetch_report(FILE *out);
+
+#endif
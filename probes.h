@@ -0,0 +1,49 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints
+ *
+ * Each PROBEn(name, ...) is a USDT probe parrots:name when <sys/sdt.h>
+ * (systemtap-sdt-dev) is installed at build time, and nothing otherwise.
+ * An unattached probe is a single nop; perf and bpftrace attach to it on
+ * a running process, e.g.
+ *
+ *      bpftrace -e 'usdt:./parrots:parrots:accept { printf("%d\n", arg0); }'
+ *
+ * A connection is identified by its client fd, from accept until
+ * request_done. Probes carry no timestamps of their own, the tracer
+ * takes them as they fire, so nothing is measured unless one is attached.
+ * See tools/ for scripts.
+ *
+ *      accept              (fd)
+ *      request_parsed      (fd, url, upstream host[:port])
+ *      upstream_start      (fd, host)
+ *      dns_start           (host)                      same thread as dns_done
+ *      dns_done            (host, addresses, error)
+ *      upstream_connected  (fd, upstream fd)
+ *      first_byte          (fd, status)
+ *      response_complete   (fd, status, body bytes)
+ *      cache_hit           (fd, url)
+ *      request_done        (fd)
+ *      job_enqueue         (func, arg, queue depth)    tpool
+ *      job_start           (func, arg)
+ *      job_finish          (func, arg)
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE1(name, a)          DTRACE_PROBE1(parrots, name, a)
+#define PROBE2(name, a, b)       DTRACE_PROBE2(parrots, name, a, b)
+#define PROBE3(name, a, b, c)    DTRACE_PROBE3(parrots, name, a, b, c)
+#endif
+#endif
+
+#ifndef PROBE1
+#define PROBE1(name, a)          do { } while (0)
+#define PROBE2(name, a, b)       do { } while (0)
+#define PROBE3(name, a, b, c)    do { } while (0)
+#endif
+
+#endif
@@ -1,7 +1,25 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
 #include "rio.h"
+#include "coro.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+static int rio_wait(int fd, short events);
+static int rio_zc_reap(int fd, unsigned int *done);
 
 /**
  *
@@ -26,7 +44,10 @@ static ssize_t rio_read(struct rio_t *rp, char *usrbuf, size_t n)
         rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
 
         if (rp->rio_cnt < 0) {
-            if (errno != EINTR) return -1;
+            if (errno == EAGAIN) {
+                // client fds are nonblocking, wait; a coroutine parks instead of the worker
+                if (rio_wait(rp->rio_fd, POLLIN) == -1) return -1;
+            } else if (errno != EINTR) return -1;
         } else if (rp->rio_cnt == 0) {  // EOF
             return 0;
         } else {
@@ -54,7 +75,7 @@ ssize_t rio_readlineb(struct rio_t *rp, void *usrbuf, size_t maxlen)
                 break;  // End of Line
             }
         } else if (rc == 0) {
-            if (n == 0)
+            if (n == 1)
                 return 0; // reading empty file
             else
                 break;  // finish reading
@@ -67,6 +88,25 @@ ssize_t rio_readlineb(struct rio_t *rp, void *usrbuf, size_t maxlen)
     return n;
 }
 
+ssize_t rio_readb(struct rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t nread;
+
+    if (rp->rio_cnt > 0 || n < sizeof(rp->rio_buf))
+        return rio_read(rp, usrbuf, n);
+
+    // nothing buffered and a big request, skip the copy through rio_buf
+    for (;;) {
+        if ((nread = read(rp->rio_fd, usrbuf, n)) >= 0)
+            return nread;
+        if (errno == EAGAIN) {
+            if (rio_wait(rp->rio_fd, POLLIN) == -1) return -1;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
 ssize_t rio_readnb(struct rio_t *rp, void *usrbuf, size_t n)
 {
     size_t nleft = n;
@@ -100,6 +140,8 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
         if ((nread = read(fd, bufp, nleft)) < 0) {
             if (errno == EINTR)
                 nread = 0; // read nothing this time
+            else if (errno == EAGAIN && rio_wait(fd, POLLIN) == 0)
+                nread = 0;
             else
                 return -1;
         } else if (nread == 0) {
@@ -122,6 +164,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
         if ((nwritten = write(fd, bufp, nleft)) <= 0) {
             if (errno == EINTR)
                 nwritten = 0;   // write nothing this time, try again
+            else if (errno == EAGAIN && rio_wait(fd, POLLOUT) == 0)
+                nwritten = 0;   // nonblocking fd and a full socket buffer
             else
                 return -1;
         }
@@ -132,3 +176,155 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 
     return n;
 }
+
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = 0;
+    ssize_t nwritten;
+
+    for (int i = 0; i < iovcnt; ++i)
+        n += iov[i].iov_len;
+
+    while (iovcnt > 0) {
+        if ((nwritten = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt)) <= 0) {
+            if (errno == EINTR)
+                nwritten = 0;
+            else if (errno == EAGAIN && rio_wait(fd, POLLOUT) == 0)
+                nwritten = 0;
+            else
+                return -1;
+        }
+
+        // skip what has been written, fully or partially
+        while (iovcnt > 0 && (size_t) nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+
+    return n;
+}
+
+ssize_t rio_sendzc(int fd, void *usrbuf, size_t n)
+{
+    size_t nleft = n;
+    ssize_t nsent;
+    char *bufp = usrbuf;
+    unsigned int calls = 0;  // each successful send owes us one notification
+    unsigned int done = 0;   // notifications received
+    int yes = 1;
+
+    /*
+     * cheap when already set, and fails on anything that is not a
+     * TCP socket or a kernel older than 4.14
+     */
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == -1)
+        return rio_writen(fd, usrbuf, n);
+
+    while (nleft > 0) {
+        if ((nsent = send(fd, bufp, nleft, MSG_ZEROCOPY)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN) {
+                if (rio_wait(fd, POLLOUT) == -1) return -1;
+                continue;
+            } else if (errno == ENOBUFS && done < calls) {
+                // out of optmem for pinned pages, wait for some to come back
+                if (rio_zc_reap(fd, &done) == -1) return -1;
+                continue;
+            } else if (errno == ENOBUFS) {
+                return rio_writen(fd, bufp, nleft) == -1 ? -1 : (ssize_t) n;
+            }
+            return -1;
+        }
+
+        calls++;
+        nleft -= nsent;
+        bufp  += nsent;
+    }
+
+    // usrbuf is pinned by the kernel until every send is acknowledged
+    while (done < calls) {
+        if (rio_zc_reap(fd, &done) == -1)
+            return -1;
+    }
+
+    return n;
+}
+
+/*
+ * Static functions
+ */
+
+static int rio_wait(int fd, short events)
+/*
+ * block until fd is ready, for callers doing blocking I/O on a nonblocking
+ * fd, but no longer than RIO_TIMEOUT: a peer that has stopped sending or
+ * reading must not keep a worker forever
+ */
+{
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    // inside a coroutine only the coroutine blocks
+    while ((rc = coro_poll(&pfd, 1, RIO_TIMEOUT)) <= 0) {
+        if (rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (errno != EINTR) return -1;
+    }
+
+    return 0;
+}
+
+static int rio_zc_reap(int fd, unsigned int *done)
+/* wait for zerocopy completions on the error queue and count them into done */
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 8];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return -1;
+            // nothing yet, the error queue shows up as POLLERR. The pages
+            // stay pinned until the notification comes, however long that
+            // takes, so only a failed socket is a reason to give up
+            struct pollfd pfd = { fd, 0, 0 };
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (coro_poll(&pfd, 1, 1000) == -1 && errno != EINTR) return -1;
+            if (pfd.revents & POLLERR) {
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+                    return -1;  // reset, the kernel has dropped what it held
+            } else if (pfd.revents & POLLHUP) {
+                coro_poll(NULL, 0, 10);  // closed, the notification is on its way
+            }
+            continue;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // notifications [ee_info, ee_data] have completed
+            *done += serr->ee_data - serr->ee_info + 1;
+        }
+        return 0;
+    }
+}
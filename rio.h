@@ -2,8 +2,10 @@
 #define RIO_H
 
 #include <unistd.h>
+#include <sys/uio.h>
 
 #define RIO_BUFSIZE 8192
+#define RIO_TIMEOUT 10000   // ms a nonblocking fd may go without progress, then -1 with ETIMEDOUT
 
 struct rio_t {
     int rio_fd;                 // descriptor used
@@ -19,10 +21,22 @@ void rio_readinitb(struct rio_t *rp, int fd);
 // read n bytes or read a line of up to maxlen bytes from rio_buf
 ssize_t rio_readlineb(struct rio_t *rp, void *usrbuf, size_t maxlen);
 ssize_t rio_readnb(struct rio_t *rp, void *usrbuf, size_t n);
+// read whatever is available, up to n bytes, waiting only if there is
+// nothing at all; 0 means EOF
+ssize_t rio_readb(struct rio_t *rp, void *usrbuf, size_t n);
 
 // unbuffered.
 // try its best to read n bytes and write n bytes using UNIX IO
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 
+// gather-write everything described by iov, using as few writev calls
+// as the kernel allows. iov is used as scratch space and is consumed.
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt);
+
+// write n bytes with MSG_ZEROCOPY so the kernel sends straight from
+// usrbuf, and return only once the kernel has released usrbuf again.
+// falls back to rio_writen where zerocopy is unavailable.
+ssize_t rio_sendzc(int fd, void *usrbuf, size_t n);
+
 #endif
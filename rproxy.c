@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "rproxy.h"
+
+#define RPROXY_BACKENDS 64
+#define RPROXY_GROUPS   16
+#define RPROXY_ROUTES   64
+#define RPROXY_NAMELEN  64
+
+#define EJECT_FAILS     3    /* failures in a row that take a backend out */
+#define EJECT_TIME      10   /* s, before it is given another request */
+
+enum route_kind { ROUTE_HOST, ROUTE_PATH, ROUTE_DEFAULT };
+
+struct route {
+    enum route_kind kind;
+    char            match[256];
+    int             group;
+};
+
+static struct backend  backends[RPROXY_BACKENDS];
+static int             backend_cnt;
+static char            groups[RPROXY_GROUPS][RPROXY_NAMELEN];
+static int             group_cnt;
+static struct route    routes[RPROXY_ROUTES];
+static int             route_cnt;
+static int             enabled;
+static unsigned int    seed = 1;
+static pthread_mutex_t rproxy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int  group_find(const char *name, int add);
+static int  route_match(struct route *r, const char *host, const char *path);
+static int  usable(struct backend *b, long now, int with_ejected);
+static long now_s();
+
+int rproxy_load(const char *path)
+{
+    FILE *fp;
+    char line[512], kind[32], a[256], b[256], c[256];
+    int lineno = 0, n, g;
+    struct backend *be;
+    struct route *r;
+    char *colon;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((colon = strchr(line, '#')) != NULL) *colon = '\0';
+        n = sscanf(line, "%31s %255s %255s %255s", kind, a, b, c);
+        if (n <= 0) continue;
+
+        if (!strcmp(kind, "backend") && n == 3) {
+            if (strlen(a) >= RPROXY_NAMELEN) {
+                fprintf(stderr, "%s:%d: group name longer than %d bytes\n", path, lineno, RPROXY_NAMELEN - 1);
+                fclose(fp);
+                return -1;
+            }
+            if (backend_cnt == RPROXY_BACKENDS || (g = group_find(a, 1)) == -1) goto toomany;
+            be = &backends[backend_cnt];
+            colon = strrchr(b, ':');
+            if (colon == NULL || colon == b || b[0] == '[') goto bad;  // host:port, a name or IPv4
+            *colon = '\0';
+            snprintf(be->host, sizeof(be->host), "%s", b);
+            snprintf(be->port, sizeof(be->port), "%s", colon + 1);
+            snprintf(be->addr, sizeof(be->addr), "%s:%s", b, colon + 1);
+            be->group = g;
+            backend_cnt++;
+        } else if (!strcmp(kind, "route") && (n == 4 || (n == 3 && !strcmp(a, "default")))) {
+            if (route_cnt == RPROXY_ROUTES) goto toomany;
+            r = &routes[route_cnt];
+            if (!strcmp(a, "host"))
+                r->kind = ROUTE_HOST;
+            else if (!strcmp(a, "path"))
+                r->kind = ROUTE_PATH;
+            else if (!strcmp(a, "default"))
+                r->kind = ROUTE_DEFAULT;
+            else
+                goto bad;
+            if (r->kind == ROUTE_DEFAULT) {
+                r->match[0] = '\0';
+                r->group = group_find(b, 0);
+            } else {
+                snprintf(r->match, sizeof(r->match), "%s", b);
+                r->group = group_find(c, 0);
+            }
+            if (r->group == -1) {
+                fprintf(stderr, "%s:%d: no backends in that group\n", path, lineno);
+                fclose(fp);
+                return -1;
+            }
+            route_cnt++;
+        } else {
+            goto bad;
+        }
+    }
+    fclose(fp);
+
+    if (route_cnt == 0) {
+        fprintf(stderr, "%s: no routes\n", path);
+        return -1;
+    }
+    enabled = 1;
+    seed = (unsigned int) time(NULL);
+    return 0;
+
+bad:
+    fprintf(stderr, "%s:%d: cannot parse \"%s\"\n", path, lineno, kind);
+    fclose(fp);
+    return -1;
+toomany:
+    fprintf(stderr, "%s:%d: too many backends or groups\n", path, lineno);
+    fclose(fp);
+    return -1;
+}
+
+int rproxy_enabled(void)
+{
+    return enabled;
+}
+
+struct backend *rproxy_route(const char *host, const char *path, struct backend *exclude)
+{
+    struct backend *cand[RPROXY_BACKENDS];
+    struct backend *pick = NULL, *other;
+    long now = now_s();
+    int i, cnt = 0, group = -1, with_ejected;
+
+    for (i = 0; i < route_cnt; i++) {
+        if (route_match(&routes[i], host, path)) {
+            group = routes[i].group;
+            break;
+        }
+    }
+    if (group == -1) return NULL;
+
+    pthread_mutex_lock(&rproxy_mutex);
+
+    /* if every backend of the group is out, better try one than fail outright */
+    for (with_ejected = 0; cnt == 0 && with_ejected < 2; with_ejected++) {
+        for (i = 0; i < backend_cnt; i++) {
+            if (backends[i].group == group && &backends[i] != exclude &&
+                usable(&backends[i], now, with_ejected))
+                cand[cnt++] = &backends[i];
+        }
+    }
+
+    /* power of two choices: as good as the least loaded, without herding to it */
+    if (cnt > 0) {
+        pick = cand[rand_r(&seed) % cnt];
+        if (cnt > 1) {
+            other = cand[rand_r(&seed) % (cnt - 1)];
+            if (other == pick) other = cand[cnt - 1];
+            if (other->outstanding < pick->outstanding) pick = other;
+        }
+        pick->outstanding++;
+    }
+
+    pthread_mutex_unlock(&rproxy_mutex);
+    return pick;
+}
+
+void rproxy_done(struct backend *b, int result)
+{
+    if (b == NULL) return;
+
+    pthread_mutex_lock(&rproxy_mutex);
+    b->outstanding--;
+    if (result > 0) {
+        b->fails = 0;
+        b->served++;
+    } else if (result < 0) {
+        b->failed++;
+        if (++b->fails >= EJECT_FAILS) {
+            if (b->ejected_until <= now_s())
+                fprintf(stderr, "rproxy: ejecting %s after %d failures\n", b->addr, b->fails);
+            b->ejected_until = now_s() + EJECT_TIME;
+        }
+    }
+    pthread_mutex_unlock(&rproxy_mutex);
+}
+
+void rproxy_report(FILE *out)
+{
+    struct backend *b;
+    long now = now_s();
+    int i;
+
+    if (!enabled) return;
+
+    pthread_mutex_lock(&rproxy_mutex);
+    for (i = 0; i < backend_cnt; i++) {
+        b = &backends[i];
+        fprintf(out, "rproxy: %s %s outstanding %d served %ld failed %ld%s\n",
+                groups[b->group], b->addr, b->outstanding, b->served, b->failed,
+                b->ejected_until > now ? " ejected" : "");
+    }
+    pthread_mutex_unlock(&rproxy_mutex);
+}
+
+/*
+ * Static functions
+ */
+
+static int group_find(const char *name, int add)
+{
+    int i;
+
+    for (i = 0; i < group_cnt; i++)
+        if (!strcmp(groups[i], name)) return i;
+    if (!add || group_cnt == RPROXY_GROUPS) return -1;
+
+    memcpy(groups[group_cnt], name, strlen(name) + 1);  // rproxy_load checked the length
+    return group_cnt++;
+}
+
+static int route_match(struct route *r, const char *host, const char *path)
+{
+    size_t len;
+
+    switch (r->kind) {
+    case ROUTE_HOST:
+        len = strlen(r->match);
+        return !strncasecmp(host, r->match, len) && (host[len] == '\0' || host[len] == ':');
+    case ROUTE_PATH:
+        return !strncmp(path, r->match, strlen(r->match));
+    default:
+        return 1;
+    }
+}
+
+static int usable(struct backend *b, long now, int with_ejected)
+{
+    return with_ejected || b->ejected_until <= now;
+}
+
+static long now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
@@ -0,0 +1,85 @@
+#ifndef RPROXY_H
+#define RPROXY_H
+
+#include <stdio.h>
+
+/*
+ * Reverse-proxy mode
+ *
+ * A config file names groups of backends and says which requests go to
+ * which group:
+ *
+ *      # group    address
+ *      backend api 127.0.0.1:9001
+ *      backend api 127.0.0.1:9002
+ *      backend web 127.0.0.1:9101
+ *
+ *      # routes are tried in order, the first match wins
+ *      route host api.example.com api
+ *      route path /static/        web
+ *      route default              web
+ *
+ * "host" matches the Host header, with or without its port, and "path"
+ * matches a prefix of the request target.
+ */
+
+struct backend {
+    char    host[256];
+    char    port[16];
+    char    addr[280];      // host:port, for logs and sched
+    int     group;
+    int     outstanding;    // requests routed to it and not yet done
+    int     fails;          // in a row
+    long    ejected_until;  // s, CLOCK_MONOTONIC; out of rotation until then
+    long    served;
+    long    failed;
+};
+
+/**
+ * @brief Read the config file and turn reverse-proxy mode on
+ *
+ * @param   path    the config file
+ * @return  0 for success and -1 otherwise, with the reason on stderr
+ */
+
+int rproxy_load(const char *path);
+
+/**
+ * @brief Whether rproxy_load has been called successfully
+ */
+
+int rproxy_enabled(void);
+
+/**
+ * @brief Pick a backend for a request
+ *
+ * Of two healthy backends of the matching group chosen at random, the
+ * one with fewer outstanding requests; backends that keep failing are
+ * left out for a while. Every backend returned must be given back with
+ * rproxy_done.
+ *
+ * @param   host     the Host header, "" if there was none
+ * @param   path     the request target, such as "/index.html"
+ * @param   exclude  a backend not to pick, e.g. one that just failed, or NULL
+ * @return  the backend, or NULL if no route matches or the group is empty
+ */
+
+struct backend *rproxy_route(const char *host, const char *path, struct backend *exclude);
+
+/**
+ * @brief Give a backend back once a request is through with it
+ *
+ * @param   b       as returned by rproxy_route
+ * @param   result  1 if it answered, -1 if it could not be reached or
+ *                  answered with a 5xx, 0 if it was never asked
+ */
+
+void rproxy_done(struct backend *b, int result);
+
+/**
+ * @brief Print outstanding requests and health per backend
+ */
+
+void rproxy_report(FILE *out);
+
+#endif
@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sched.h"
+
+#define SCHED_HOSTS      256    /* hosts tracked at once */
+#define SCHED_HOSTLEN    256
+#define SCHED_QUEUE_MAX  64     /* jobs waiting per host, more are refused */
+#define SCHED_HOST_SHARE 50     /* percent of the slots one host may hold */
+#define SCHED_QUANTUM    10     /* ms of worker time credited per round */
+#define SCHED_COST_MAX   10000  /* ms, most one job is charged */
+
+/*
+ * Deficit round-robin
+ *
+ * Hosts with work waiting sit on a ring. A host at the front of the ring
+ * starts jobs while its deficit covers what its jobs have recently been
+ * costing in worker time, and is otherwise credited SCHED_QUANTUM and
+ * sent to the back. A host whose jobs take seconds thus starts them far
+ * less often than one whose jobs take milliseconds, and either gives up
+ * the ring while it holds its share of the slots.
+ */
+
+struct sched_job {
+    thr_func_t         func;
+    void              *arg;
+    struct sched_host *host;
+    long               queued;  // ms, when it was submitted
+    struct sched_job  *next;
+};
+
+struct sched_host {
+    char               name[SCHED_HOSTLEN];  // "" if the entry is free
+    struct sched_job  *head;
+    struct sched_job  *tail;
+    int                depth;     // jobs waiting
+    int                running;
+    long               deficit;   // ms of worker time it may still start
+    long               cost;      // ms, moving average of its jobs' run time
+    int                on_ring;
+    struct sched_host *ring_prev;
+    struct sched_host *ring_next;
+
+    long               started;   // since the last report
+    long               wait_sum;
+    long               wait_max;
+    long               refused;
+};
+
+static tpool_t           *pool;
+static int                slots;
+static int                host_max;
+static int                running;
+static int                queued;
+static void             (*idle_hook)(void);
+static struct sched_host  hosts[SCHED_HOSTS];
+static struct sched_host *ring;      // whose turn it is
+static pthread_mutex_t    sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sched_host *host_get(const char *name);
+static void ring_add(struct sched_host *h);
+static void ring_remove(struct sched_host *h);
+static void dispatch();
+static void skip_rounds();
+static int  idle();
+static void sched_run(void *arg);
+static long now_ms();
+
+int sched_init(tpool_t *tpool, int num)
+{
+    if (tpool == NULL || num < 1) return -1;
+
+    pthread_mutex_lock(&sched_mutex);
+    pool = tpool;
+    slots = num;
+    host_max = (num * SCHED_HOST_SHARE + 99) / 100;
+    if (host_max < 1) host_max = 1;
+    pthread_mutex_unlock(&sched_mutex);
+
+    return 0;
+}
+
+int sched_submit(const char *name, thr_func_t func, void *arg)
+{
+    struct sched_job *job;
+    struct sched_host *h = NULL;
+
+    job = (struct sched_job *) malloc(sizeof(*job));
+    if (job == NULL) return -1;
+    job->func = func;
+    job->arg = arg;
+    job->queued = now_ms();
+    job->next = NULL;
+
+    pthread_mutex_lock(&sched_mutex);
+    if (pool == NULL || (h = host_get(name)) == NULL || h->depth >= SCHED_QUEUE_MAX) {
+        if (pool != NULL && h != NULL) h->refused++;
+        pthread_mutex_unlock(&sched_mutex);
+        free(job);
+        return -1;
+    }
+
+    job->host = h;
+    if (h->tail == NULL)
+        h->head = job;
+    else
+        h->tail->next = job;
+    h->tail = job;
+    h->depth++;
+    queued++;
+
+    if (!h->on_ring && h->running < host_max)
+        ring_add(h);
+    dispatch();
+    pthread_mutex_unlock(&sched_mutex);
+
+    return 0;
+}
+
+int sched_slots(void)
+{
+    int ret;
+
+    pthread_mutex_lock(&sched_mutex);
+    ret = pool != NULL ? slots : 0;
+    pthread_mutex_unlock(&sched_mutex);
+
+    return ret;
+}
+
+int sched_idle(void)
+{
+    int ret;
+
+    pthread_mutex_lock(&sched_mutex);
+    ret = idle();
+    pthread_mutex_unlock(&sched_mutex);
+
+    return ret;
+}
+
+void sched_on_idle(void (*hook)(void))
+{
+    idle_hook = hook;
+}
+
+void sched_report(FILE *out)
+{
+    struct sched_host *h;
+    int i;
+
+    pthread_mutex_lock(&sched_mutex);
+    fprintf(out, "sched: %d of %d slots running, at most %d per host\n", running, slots, host_max);
+    for (i = 0; i < SCHED_HOSTS; i++) {
+        h = &hosts[i];
+        if (h->name[0] == '\0') continue;
+        fprintf(out, "sched: %s queued %d running %d started %ld wait avg %ld ms max %ld ms cost %ld ms refused %ld\n",
+                h->name, h->depth, h->running, h->started,
+                h->started ? h->wait_sum / h->started : 0, h->wait_max, h->cost, h->refused);
+        h->started = h->wait_sum = h->wait_max = h->refused = 0;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ * Static functions, called with sched_mutex held
+ */
+
+static struct sched_host *host_get(const char *name)
+/* the entry for name, taking a free or idle one if it has none */
+{
+    struct sched_host *spare = NULL;
+    int i;
+
+    for (i = 0; i < SCHED_HOSTS; i++) {
+        if (!strcmp(hosts[i].name, name)) return &hosts[i];
+        if (spare == NULL && hosts[i].depth == 0 && hosts[i].running == 0)
+            spare = &hosts[i];
+    }
+    if (spare == NULL) return NULL;  // every entry has work, turn the new host away
+
+    memset(spare, 0, sizeof(*spare));
+    snprintf(spare->name, SCHED_HOSTLEN, "%s", name);
+    spare->cost = SCHED_QUANTUM;     // nothing known yet, assume it is quick
+    return spare;
+}
+
+static void ring_add(struct sched_host *h)
+/* at the back, just behind whoever's turn it is */
+{
+    if (ring == NULL) {
+        h->ring_prev = h->ring_next = h;
+        ring = h;
+    } else {
+        h->ring_next = ring;
+        h->ring_prev = ring->ring_prev;
+        ring->ring_prev->ring_next = h;
+        ring->ring_prev = h;
+    }
+    h->on_ring = 1;
+}
+
+static void ring_remove(struct sched_host *h)
+{
+    if (h->ring_next == h) {
+        ring = NULL;
+    } else {
+        h->ring_prev->ring_next = h->ring_next;
+        h->ring_next->ring_prev = h->ring_prev;
+        if (ring == h) ring = h->ring_next;
+    }
+    h->on_ring = 0;
+}
+
+static void dispatch()
+/* hand jobs to the threadpool while slots are free, in turn */
+{
+    struct sched_host *h;
+    struct sched_job *job;
+
+    while (running < slots && ring != NULL) {
+        h = ring;
+        if (h->head == NULL || h->running >= host_max) {
+            ring_remove(h);  // back on once it has work and room again
+            continue;
+        }
+        if (h->deficit < h->cost) {
+            skip_rounds();  // rather than going round cost / SCHED_QUANTUM times
+            h->deficit += SCHED_QUANTUM;
+            ring = h->ring_next;
+            continue;
+        }
+
+        job = h->head;
+        if (tpool_add_job(pool, sched_run, job) == -1) {
+            perror("tpool_add_job");
+            break;  // try again when the next job finishes
+        }
+        h->head = job->next;
+        if (h->head == NULL) h->tail = NULL;
+        h->depth--;
+        queued--;
+        h->running++;
+        h->deficit -= h->cost;
+        running++;
+
+        if (h->head == NULL) {
+            h->deficit = 0;  // an idle host does not save up credit
+            ring_remove(h);
+        }
+    }
+}
+
+static void sched_run(void *arg)
+{
+    struct sched_job *job = arg;
+    struct sched_host *h = job->host;
+    long start = now_ms();
+    long wait = start - job->queued;
+    long took;
+    int call_hook;
+
+    pthread_mutex_lock(&sched_mutex);
+    h->started++;
+    h->wait_sum += wait;
+    if (wait > h->wait_max) h->wait_max = wait;
+    pthread_mutex_unlock(&sched_mutex);
+
+    job->func(job->arg);
+
+    took = now_ms() - start;
+    if (took > SCHED_COST_MAX) took = SCHED_COST_MAX;
+
+    pthread_mutex_lock(&sched_mutex);
+    h->cost = (h->cost * 7 + took) / 8;
+    if (h->cost < 1) h->cost = 1;
+    h->running--;
+    running--;
+    if (h->head != NULL && !h->on_ring)
+        ring_add(h);
+    dispatch();
+    call_hook = idle_hook != NULL && idle();
+    pthread_mutex_unlock(&sched_mutex);
+
+    free(job);
+    if (call_hook) idle_hook();
+}
+
+static void skip_rounds()
+/* credit at once the rounds in which no host on the ring could start a job */
+{
+    struct sched_host *h = ring;
+    long need, rounds = -1;
+
+    do {
+        if (h->head != NULL && h->running < host_max) {
+            need = (h->cost - h->deficit + SCHED_QUANTUM - 1) / SCHED_QUANTUM;
+            if (rounds == -1 || need < rounds) rounds = need;
+        }
+    } while ((h = h->ring_next) != ring);
+
+    if (rounds <= 1) return;  // somebody can start in this round or the next
+    do {
+        if (h->head != NULL && h->running < host_max)
+            h->deficit += (rounds - 1) * SCHED_QUANTUM;
+    } while ((h = h->ring_next) != ring);
+}
+
+static int idle()
+{
+    return pool == NULL || (queued == 0 && running <= slots / 2);
+}
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
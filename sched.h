@@ -0,0 +1,82 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdio.h>
+#include "tpool.h"
+
+/**
+ * @brief Put a per-host scheduler in front of a threadpool
+ *
+ * @example
+ *
+ *      ..
+ *      tpool_t *tpool = tpool_create(8);
+ *      sched_init(tpool, 7);
+ *      ..
+ *      if (sched_submit("example.com:80", forward, req) == -1)
+ *          turn_away(req);
+ *      ..
+ *
+ * Work submitted to the scheduler is queued per host and handed to the
+ * threadpool only while fewer than slots jobs are running, so the
+ * threadpool's own queue stays short. Hosts take turns by deficit
+ * round-robin, charged by how long their jobs have been taking, and no
+ * host may have more than its share of the slots at once; a host whose
+ * jobs have become slow cannot take the workers from the others.
+ *
+ * @param  tpool, the threadpool that runs the jobs
+ * @param  slots, jobs allowed to run at once, at least 1
+ * @return 0 for success and -1 otherwise
+ */
+
+int sched_init(tpool_t *tpool, int slots);
+
+/**
+ * @brief Queue func(arg) behind the other work for host
+ *
+ * @param   host  the upstream the job talks to, such as "example.com:80"
+ * @param   func  a function pointer
+ * @param   arg   argument(s) can be passed as pointers
+ * @return  0 for success, -1 if the host's queue is full or sched_init
+ *          has not been called, func is not run then
+ */
+
+int sched_submit(const char *host, thr_func_t func, void *arg);
+
+/**
+ * @brief The number of jobs allowed to run at once
+ *
+ * @return  slots as given to sched_init, 0 if it has not been called
+ */
+
+int sched_slots(void);
+
+/**
+ * @brief Whether there is capacity to spare for background work
+ *
+ * @return  1 if nothing is queued and at most half the slots are
+ *          running, or if sched_init has not been called; 0 otherwise
+ */
+
+int sched_idle(void);
+
+/**
+ * @brief Have hook called whenever a job ends and leaves sched_idle true
+ *
+ * hook is called without any lock held and may call sched_submit.
+ */
+
+void sched_on_idle(void (*hook)(void));
+
+/**
+ * @brief Print queue depth, running jobs and queueing delay per host
+ *
+ * Delays are those of the jobs started since the previous report.
+ *
+ * @param   out   where to print, e.g. stderr
+ * @return  nothing
+ */
+
+void sched_report(FILE *out);
+
+#endif
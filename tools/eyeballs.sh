@@ -0,0 +1,92 @@
+#!/bin/bash
+#
+# Happy Eyeballs against a blackholed loopback address, without a
+# firewall: 127.0.0.1 listens with a full backlog and never accepts, so
+# the kernel drops SYNs to it just as a firewall would. eyeballs.test
+# resolves to it, tried first since it matches our source address, and
+# to 127.0.0.2, where a real origin listens.
+# Needs root for /etc/hosts, and parrots built in the current directory
+# with nothing else on port 3333.
+#
+#      sudo tools/eyeballs.sh
+#
+#      1  dead address first: answered after one stagger, then remembered
+#      2  with it known-bad: answered without waiting for the stagger
+#      3  the good address goes away and the known-bad one comes back:
+#         still answered, known-bad addresses are tried last, not never
+#
+
+PORT=18080
+PROXY=http://127.0.0.1:3333
+HOST=eyeballs.test
+WORK=$(mktemp -d)
+FAILED=0
+
+cleanup() {
+    kill $(jobs -p) 2>/dev/null
+    cp "$WORK/hosts" /etc/hosts
+    rm -rf "$WORK"
+}
+
+origin() {
+    python3 -m http.server $PORT --bind $1 --directory "$WORK" >/dev/null 2>&1 &
+    echo $!
+}
+
+check() {
+    if [ "$2" = 0 ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        FAILED=1
+    fi
+}
+
+fetch() {
+    curl -s -o /dev/null -x $PROXY -w "%{http_code} %{time_total}" "http://$HOST:$PORT/?$1"
+}
+
+cp /etc/hosts "$WORK/hosts"
+trap cleanup EXIT
+printf '127.0.0.1 %s\n127.0.0.2 %s\n' $HOST $HOST >> /etc/hosts
+echo hello > "$WORK/index.html"
+
+python3 - $PORT <<'EOF' &
+import socket, sys, time
+port = int(sys.argv[1])
+l = socket.socket()
+l.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+l.bind(("127.0.0.1", port))
+l.listen(0)
+held = []
+for i in range(4):  # fill the accept queue, later SYNs are dropped
+    s = socket.socket()
+    s.setblocking(False)
+    try:
+        s.connect(("127.0.0.1", port))
+    except BlockingIOError:
+        pass
+    held.append(s)
+time.sleep(3600)
+EOF
+BLACKHOLE=$!
+GOOD=$(origin 127.0.0.2)
+./parrots 2>"$WORK/parrots.log" &
+sleep 1
+
+read code secs <<< "$(fetch 1)"
+check "dead address first: $code in ${secs}s" $([ "$code" = 200 ] && awk "BEGIN { exit !($secs >= 0.2) }"; echo $?)
+
+read code secs <<< "$(fetch 2)"
+check "dead address known-bad: $code in ${secs}s" $([ "$code" = 200 ] && awk "BEGIN { exit !($secs < 0.2) }"; echo $?)
+
+kill $BLACKHOLE $GOOD
+wait $BLACKHOLE $GOOD 2>/dev/null
+origin 127.0.0.1 >/dev/null
+sleep 1
+
+read code secs <<< "$(fetch 3)"
+check "only the known-bad address left: $code in ${secs}s" $([ "$code" = 200 ]; echo $?)
+
+[ $FAILED = 0 ] || grep upstream "$WORK/parrots.log"
+exit $FAILED
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Restart under load: clients keep fetching through parrots while it is
+# sent SIGUSR2 and hands the listening socket and the cache to a new
+# process. Not one request may be refused, reset or answered with an
+# error. Needs parrots built in the current directory with nothing else
+# on port 3333 or 18081.
+#
+#      tools/restart.sh [clients] [seconds before and after the restart]
+#
+
+CLIENTS=${1:-8}
+SECS=${2:-3}
+PORT=18081
+PROXY=http://127.0.0.1:3333
+WORK=$(mktemp -d)
+FAILED=0
+
+cleanup() {
+    kill $(jobs -p) $NEW 2>/dev/null
+    rm -rf "$WORK"
+}
+
+check() {
+    if [ "$2" = 0 ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        FAILED=1
+    fi
+}
+
+# fetch until told to stop, one line per request: curl's exit code and the status
+client() {
+    local i=0
+    while [ ! -e "$WORK/stop" ]; do
+        i=$((i + 1))
+        # mostly cached, some not, so requests are in flight towards the origin too
+        code=$(curl -s -o /dev/null -w "%{http_code}" -x $PROXY "http://127.0.0.1:$PORT/?$1-$((i % 20))")
+        echo "$? $code"
+    done > "$WORK/client.$1"
+}
+
+trap cleanup EXIT
+head -c 100000 /dev/urandom > "$WORK/index.html"
+python3 -m http.server $PORT --bind 127.0.0.1 --directory "$WORK" >/dev/null 2>&1 &
+./parrots 2>"$WORK/parrots.log" &
+OLD=$!
+sleep 1
+
+for c in $(seq 1 $CLIENTS); do
+    client $c &
+    CLIENT_PIDS="$CLIENT_PIDS $!"
+done
+sleep $SECS
+kill -USR2 $OLD
+sleep $SECS
+touch "$WORK/stop"
+wait $CLIENT_PIDS
+NEW=$(sed -n 's/^restart: started \([0-9]*\)/\1/p' "$WORK/parrots.log")
+
+check "handed over from $OLD to ${NEW:-nobody}" $(grep -q "restart: handed over" "$WORK/parrots.log"; echo $?)
+total=$(cat "$WORK"/client.* | wc -l)
+bad=$(cat "$WORK"/client.* | grep -vc "^0 200$")
+check "$bad of $total requests refused, reset or failed" $([ $total -gt 0 ] && [ $bad = 0 ]; echo $?)
+
+[ $FAILED = 0 ] || { cat "$WORK"/client.* | sort | uniq -c; grep restart "$WORK/parrots.log"; }
+exit $FAILED
@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Reverse-proxy mode against N local backends, each answering /id with
+# its own port. Needs parrots built in the current directory with nothing
+# else on port 3333 or on ports 9001 and up.
+#
+#      tools/rproxy.sh [N]
+#
+#      1  distribution: every backend gets a share of the requests
+#      2  retry: with one backend killed, every request is still answered
+#      3  ejection: the dead backend is taken out of rotation and skipped
+#
+
+N=${1:-4}
+REQS=$((N * 25))
+PROXY=http://127.0.0.1:3333
+WORK=$(mktemp -d)
+FAILED=0
+
+cleanup() {
+    kill $(jobs -p) 2>/dev/null
+    rm -rf "$WORK"
+}
+
+check() {
+    if [ "$2" = 0 ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        FAILED=1
+    fi
+}
+
+# one line per request: the answering port, or the status code if not 200
+run() {
+    for i in $(seq 1 $REQS); do
+        # a new query every time, or the cache answers instead of a backend
+        curl -s -w " %{http_code}\n" "$PROXY/id?$1-$i" | awk '$NF == 200 { print $1; next } { print $NF }'
+    done
+}
+
+trap cleanup EXIT
+for i in $(seq 1 $N); do
+    mkdir "$WORK/$i"
+    echo -n $((9000 + i)) > "$WORK/$i/id"
+    python3 -m http.server $((9000 + i)) --bind 127.0.0.1 --directory "$WORK/$i" >/dev/null 2>&1 &
+    echo "backend pool 127.0.0.1:$((9000 + i))" >> "$WORK/config"
+    eval PID_$i=$!
+done
+echo "route default pool" >> "$WORK/config"
+./parrots -r "$WORK/config" 2>"$WORK/parrots.log" &
+sleep 1
+
+run a > "$WORK/a"
+for i in $(seq 1 $N); do
+    got=$(grep -c "^$((9000 + i))$" "$WORK/a")
+    check "backend $((9000 + i)) served $got of $REQS" $([ $got -ge $((REQS / N / 3)) ]; echo $?)
+done
+
+kill $PID_1
+wait $PID_1 2>/dev/null
+run b > "$WORK/b"
+bad=$(grep -vc "^90" "$WORK/b")
+check "one backend down: $bad of $REQS not answered" $([ $bad = 0 ]; echo $?)
+
+tries=$(grep -c "rproxy: 127.0.0.1:9001 unreachable" "$WORK/parrots.log")
+check "dead backend ejected after $tries tries" \
+    $(grep -q "ejecting 127.0.0.1:9001" "$WORK/parrots.log" && [ $tries -le 5 ]; echo $?)
+
+[ $FAILED = 0 ] || grep rproxy "$WORK/parrots.log"
+exit $FAILED
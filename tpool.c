@@ -1,6 +1,12 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "tpool.h"
+#include "probes.h"
 
 #ifdef DE_BUG
 #include <stdio.h>
@@ -10,19 +16,49 @@ static void *tpool_worker(void *arg);
 static void  tpool_job_destroy(tpool_job_t *job);
 static tpool_job_t *tpool_job_get(tpool_t *tpool);
 static tpool_job_t *tpool_job_create(thr_func_t func, void *arg);
+static int   tpool_job_add(tpool_t *tpool, thr_func_t func, void *arg, int urgent);
+static int   nth_cpu(const cpu_set_t *set, int n);
+
+struct tpool_worker_arg {
+    tpool_t *tpool;
+    size_t   local_size;
+};
+
+static __thread void   *worker_local;
+static __thread size_t  worker_local_size;
 
 tpool_t *tpool_create(int num)
+{
+    return tpool_create_attr(num, NULL);
+}
+
+tpool_t *tpool_create_attr(int num, const tpool_attr_t *attr)
 {
 #ifdef DE_BUG
     perror("tp_create");
 #endif
     tpool_t     *tpool;
     pthread_t   thread;
+    pthread_attr_t thr_attr;
+    cpu_set_t   cpuset;
+    cpu_set_t   allowed;
+    int         ncpu = 0;
+    struct tpool_worker_arg *warg;
+
+    if (attr != NULL && attr->cpu_cnt == TPOOL_CPU_EACH) {
+        /* the CPUs taskset, cpusets and hotplug leave us, not 0..online-1 */
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+            ncpu = CPU_COUNT(&allowed);
+        if (num == 0) num = ncpu > 0 ? ncpu : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    } else if (attr != NULL && attr->cpus != NULL) {
+        ncpu = attr->cpu_cnt;
+    }
 
     if (num == 0) num = 2;
 
     tpool = (tpool_t *) malloc(sizeof(tpool_t));
     tpool->thread_cnt = num;
+    tpool->working_cnt = 0;
     tpool->stopped = 0;
 
     pthread_mutex_init(&(tpool->work_mutex), NULL);
@@ -31,10 +67,37 @@ tpool_t *tpool_create(int num)
 
     tpool->jobq_head = NULL;
     tpool->jobq_tail  = NULL;
+    tpool->jobq_urgent = NULL;
+    tpool->jobq_cnt   = 0;
 
     for (int i = 0; i < num; ++i) {
-        pthread_create(&thread, NULL, tpool_worker, tpool);
-        pthread_detach(thread); // no need to wait
+        warg = (struct tpool_worker_arg *) malloc(sizeof(struct tpool_worker_arg));
+        warg->tpool      = tpool;
+        warg->local_size = attr != NULL ? attr->local_size : 0;
+
+        pthread_attr_init(&thr_attr);
+        if (ncpu > 0) {
+            /*
+             * bind before the thread exists rather than from inside it, so
+             * that not even its first stack page is faulted in elsewhere
+             */
+            CPU_ZERO(&cpuset);
+            CPU_SET(attr->cpu_cnt == TPOOL_CPU_EACH ? nth_cpu(&allowed, i % ncpu) : attr->cpus[i % ncpu], &cpuset);
+            pthread_attr_setaffinity_np(&thr_attr, sizeof(cpuset), &cpuset);
+        }
+
+        if (pthread_create(&thread, &thr_attr, tpool_worker, warg) != 0 &&
+            /* most likely a CPU we are not allowed on, run it unpinned */
+            pthread_create(&thread, NULL, tpool_worker, warg) != 0) {
+            /* no worker then, the pool is one smaller */
+            free(warg);
+            pthread_mutex_lock(&(tpool->work_mutex));
+            tpool->thread_cnt--;
+            pthread_mutex_unlock(&(tpool->work_mutex));
+        } else {
+            pthread_detach(thread); // no need to wait
+        }
+        pthread_attr_destroy(&thr_attr);
     }
 
     return tpool;
@@ -57,6 +120,9 @@ void tpool_destroy(tpool_t *tpool)
         tpool_job_destroy(job);
         job = job2;
     }
+    tpool->jobq_head = NULL;
+    tpool->jobq_tail = NULL;
+    tpool->jobq_cnt  = 0;
 
     tpool->stopped = 1;
     pthread_cond_broadcast(&(tpool->work_cond));
@@ -76,6 +142,16 @@ int tpool_add_job(tpool_t *tpool, thr_func_t func, void *arg)
 #ifdef DE_BUG
     perror("tp_add_job");
 #endif
+    return tpool_job_add(tpool, func, arg, 0);
+}
+
+int tpool_add_job_urgent(tpool_t *tpool, thr_func_t func, void *arg)
+{
+    return tpool_job_add(tpool, func, arg, 1);
+}
+
+static int tpool_job_add(tpool_t *tpool, thr_func_t func, void *arg, int urgent)
+{
     tpool_job_t *job;
 
     if (tpool == NULL) return -1;
@@ -84,13 +160,22 @@ int tpool_add_job(tpool_t *tpool, thr_func_t func, void *arg)
     if (job == NULL) return -1; 
 
     pthread_mutex_lock(&(tpool->work_mutex));
-    if (tpool->jobq_head == NULL) {
+    if (urgent) {
+        /* behind the other urgent ones, ahead of the rest */
+        tpool_job_t **pp = tpool->jobq_urgent != NULL ? &tpool->jobq_urgent->next : &tpool->jobq_head;
+        job->next = *pp;
+        *pp = job;
+        if (job->next == NULL) tpool->jobq_tail = job;
+        tpool->jobq_urgent = job;
+    } else if (tpool->jobq_head == NULL) {
         tpool->jobq_head = job;
         tpool->jobq_tail = tpool->jobq_head;
     } else {
         tpool->jobq_tail->next = job;
         tpool->jobq_tail       = job;
     }
+    tpool->jobq_cnt++;
+    PROBE3(job_enqueue, func, arg, tpool->jobq_cnt);
 
     pthread_cond_broadcast(&(tpool->work_cond));
     pthread_mutex_unlock(&(tpool->work_mutex));
@@ -118,6 +203,24 @@ void tpool_wait(tpool_t *tpool)
     pthread_mutex_unlock(&(tpool->work_mutex));
 }
 
+size_t tpool_job_cnt(tpool_t *tpool)
+{
+    size_t cnt;
+
+    if (tpool == NULL) return 0;
+
+    pthread_mutex_lock(&(tpool->work_mutex));
+    cnt = tpool->jobq_cnt;
+    pthread_mutex_unlock(&(tpool->work_mutex));
+
+    return cnt;
+}
+
+void *tpool_local(size_t *size)
+{
+    if (size != NULL) *size = worker_local_size;
+    return worker_local;
+}
 
 /*
  * Static functions
@@ -169,6 +272,8 @@ static tpool_job_t *tpool_job_get(tpool_t *tpool)
     } else {
         tpool->jobq_head = job->next;
     }
+    if (tpool->jobq_urgent == job) tpool->jobq_urgent = NULL;
+    tpool->jobq_cnt--;
 
     return job;
 }
@@ -179,9 +284,26 @@ static void *tpool_worker(void *arg)
 #ifdef DE_BUG
     perror("tp_worker");
 #endif
-    tpool_t      *tpool = arg;
+    struct tpool_worker_arg *warg = arg;
+    tpool_t      *tpool = warg->tpool;
     tpool_job_t *job;
 
+    if (warg->local_size > 0) {
+        /*
+         * the default policy places a page on the node of the CPU that
+         * first touches it, and we are already running on our own CPU
+         */
+        worker_local = mmap(NULL, warg->local_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (worker_local == MAP_FAILED) {
+            worker_local = NULL;
+        } else {
+            memset(worker_local, 0, warg->local_size);
+            worker_local_size = warg->local_size;
+        }
+    }
+    free(warg);
+
     while (1) {
         pthread_mutex_lock(&(tpool->work_mutex));
         while (tpool->jobq_head == NULL && !tpool->stopped)
@@ -194,7 +316,9 @@ static void *tpool_worker(void *arg)
         pthread_mutex_unlock(&(tpool->work_mutex));
 
         if (job != NULL) {
+            PROBE2(job_start, job->func, job->arg);
             job->func(job->arg);
+            PROBE2(job_finish, job->func, job->arg);
             tpool_job_destroy(job);
         }
 
@@ -209,5 +333,22 @@ static void *tpool_worker(void *arg)
     pthread_cond_signal(&(tpool->working_cond));
     pthread_mutex_unlock(&(tpool->work_mutex));
 
+    if (worker_local != NULL) {
+        munmap(worker_local, worker_local_size);
+        worker_local = NULL;
+        worker_local_size = 0;
+    }
+
     return NULL;
 }
+
+static int nth_cpu(const cpu_set_t *set, int n)
+/* the number of the n-th CPU in set, counting from 0 */
+{
+    int cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, set) && n-- == 0) return cpu;
+    }
+    return 0;
+}
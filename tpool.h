@@ -14,6 +14,8 @@ typedef struct tpool_job tpool_job_t;
 struct tpool {
     tpool_job_t    *jobq_head;
     tpool_job_t    *jobq_tail;
+    tpool_job_t    *jobq_urgent;  // last job from tpool_add_job_urgent still waiting, or NULL
+    size_t          jobq_cnt;     // jobs waiting in the queue
 
     pthread_mutex_t work_mutex;   // counting jobs, others should wait
     pthread_cond_t  work_cond;    // there are new jobs
@@ -25,6 +27,16 @@ struct tpool {
 
 typedef struct tpool tpool_t;
 
+#define TPOOL_CPU_EACH -1   // cpu_cnt value: one pinned worker per CPU we may run on
+
+struct tpool_attr {
+    const int *cpus;        // CPUs to pin workers to, worker i runs on cpus[i % cpu_cnt]
+    int        cpu_cnt;     // entries in cpus, 0 for no pinning or TPOOL_CPU_EACH
+    size_t     local_size;  // bytes of scratch memory each worker keeps on its own node
+};
+
+typedef struct tpool_attr tpool_attr_t;
+
 /**
  * @brief Initialize a threadpool
  * 
@@ -41,6 +53,31 @@ typedef struct tpool tpool_t;
 
 tpool_t *tpool_create(int num);
 
+/**
+ * @brief Initialize a threadpool with pinned workers
+ *
+ * @example
+ *
+ *      ..
+ *      int cpus[] = {0, 2, 4, 6};
+ *      tpool_attr_t attr = { cpus, 4, 64 * 1024 };
+ *      tpool_t *tpool = tpool_create_attr(8, &attr);
+ *      ..
+ *
+ * Each worker is created already bound to its CPU, so its stack and its
+ * scratch memory (see tpool_local) are first touched, and therefore
+ * allocated, on that CPU's NUMA node. With cpu_cnt set to TPOOL_CPU_EACH,
+ * cpus is ignored, workers go to the CPUs in our affinity mask in turn,
+ * and a num of 0 means one worker per CPU in it.
+ *
+ * @param  num,       the number of threads you want to create
+ * @param  attr,      placement options, NULL behaves like tpool_create
+ * @return tpool_t *, a pointer to the threadpool structure
+ *
+ */
+
+tpool_t *tpool_create_attr(int num, const tpool_attr_t *attr);
+
 /**
  * @brief Destroy a threadpool
  *
@@ -81,6 +118,20 @@ void    tpool_destroy(tpool_t *tpool);
 
 int     tpool_add_job(tpool_t *tpool, thr_func_t func, void *arg);
 
+/**
+ * @brief Add work ahead of everything queued with tpool_add_job
+ *
+ * Urgent jobs run in the order they were added, before any job from
+ * tpool_add_job that is still waiting.
+ *
+ * @param   tpool       a pointer to the threadpool
+ * @param   thr_func_t  a function pointer
+ * @param   arg         argument(s) can be passed as pointers
+ * @return  0 for success and -1 otherwise
+ */
+
+int     tpool_add_job_urgent(tpool_t *tpool, thr_func_t func, void *arg);
+
 /**
  * @brief Wait for all queued tasks to finish
  * @example
@@ -99,4 +150,39 @@ int     tpool_add_job(tpool_t *tpool, thr_func_t func, void *arg);
 
 void    tpool_wait(tpool_t *tpool);
 
+/**
+ * @brief Number of jobs queued but not yet picked up by a worker
+ * @example
+ *
+ *      ..
+ *      if (tpool_job_cnt(tpool) >= MAX_QUEUE)
+ *          shed_load();
+ *      ..
+ *
+ * @param   tpool   a pointer to the threadpool
+ * @return  the current depth of the job queue
+ */
+
+size_t  tpool_job_cnt(tpool_t *tpool);
+
+/**
+ * @brief Scratch memory of the calling worker
+ * @example
+ *
+ *      ..
+ *      size_t size;
+ *      char *buf = tpool_local(&size);
+ *      if (buf == NULL || size < needed)
+ *          buf = malloc(needed);
+ *      ..
+ *
+ * The memory belongs to the worker and is reused by every job it runs,
+ * so it must not be kept past the end of the job.
+ *
+ * @param   size    set to the size of the scratch memory
+ * @return  NULL when not called from a worker or when local_size was 0
+ */
+
+void   *tpool_local(size_t *size);
+
 #endif
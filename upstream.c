@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include "upstream.h"
+#include "coro.h"
+#include "utils.h"
+#include "probes.h"
+
+#define UPSTREAM_STAGGER  250    /* ms between attempts, RFC 8305 recommends 250 */
+#define UPSTREAM_TIMEOUT  10000  /* ms before we give up on all of them */
+#define UPSTREAM_MAXADDR  16     /* addresses of a host we are willing to try */
+#define UPSTREAM_FASTOPEN 0      /* client side TCP Fast Open, see below */
+
+#define BAD_SLOTS 64   /* addresses we remember as failing */
+#define BAD_TTL   30   /* seconds an address stays known-bad */
+
+/*
+ * Client-side TCP Fast Open (TCP_FASTOPEN_CONNECT) makes connect() return
+ * at once and defers the SYN to the first write, so it cannot take part
+ * in a race. It is only used when a host is down to a single address
+ * we are going to try.
+ */
+
+struct bad_addr {
+    struct sockaddr_storage addr;
+    socklen_t               addrlen;
+    time_t                  until;
+};
+
+static struct bad_addr  bad_addrs[BAD_SLOTS];
+static pthread_mutex_t  bad_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int  addr_is_bad(struct addrinfo *ai);
+static void addr_mark(struct addrinfo *ai, int bad);
+static int  attempt_start(struct addrinfo *ai, int fastopen);
+static long now_ms();
+
+int upstream_connect(const char *host, const char *port)
+{
+    struct addrinfo hints, *servlist, *serv;
+    struct addrinfo *cand[UPSTREAM_MAXADDR], *bad[UPSTREAM_MAXADDR];
+    struct addrinfo *v6[UPSTREAM_MAXADDR], *v4[UPSTREAM_MAXADDR];
+    int  n6 = 0, n4 = 0, ncand = 0, nbad = 0;
+    struct pollfd   pfd[UPSTREAM_MAXADDR];
+    struct addrinfo *pending[UPSTREAM_MAXADDR];
+    long started[UPSTREAM_MAXADDR];
+    long won_at = 0;
+    int  npending = 0, next = 0;
+    int  sockfd = -1;
+    int  err, i;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    PROBE1(dns_start, host);
+    if ((err = getaddrinfo(host, port, &hints, &servlist))) {
+        PROBE3(dns_done, host, 0, err);
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    /* split by family, keeping the resolver's order within each */
+    for (serv = servlist; serv != NULL; serv = serv->ai_next) {
+        if (serv->ai_family == AF_INET6 && n6 < UPSTREAM_MAXADDR)
+            v6[n6++] = serv;
+        else if (serv->ai_family == AF_INET && n4 < UPSTREAM_MAXADDR)
+            v4[n4++] = serv;
+    }
+    PROBE3(dns_done, host, n6 + n4, 0);
+
+    /*
+     * interleave the families, starting with the one the resolver
+     * preferred, and put known-bad addresses after all the others: our
+     * memory is all we have against them, and one may have come back.
+     */
+    int first6 = servlist->ai_family == AF_INET6;
+    for (i = 0; i < n6 || i < n4; ++i) {
+        struct addrinfo *pair[2] = {
+            first6 ? (i < n6 ? v6[i] : NULL) : (i < n4 ? v4[i] : NULL),
+            first6 ? (i < n4 ? v4[i] : NULL) : (i < n6 ? v6[i] : NULL),
+        };
+        for (int j = 0; j < 2; ++j) {
+            if (pair[j] == NULL) continue;
+            if (addr_is_bad(pair[j])) {
+                if (nbad < UPSTREAM_MAXADDR) bad[nbad++] = pair[j];
+            } else if (ncand < UPSTREAM_MAXADDR) {
+                cand[ncand++] = pair[j];
+            }
+        }
+    }
+    for (i = 0; i < nbad && ncand < UPSTREAM_MAXADDR; ++i)
+        cand[ncand++] = bad[i];
+    if (nbad > 0)
+        fprintf(stderr, "upstream: %s, trying %d known-bad address(es) last\n", host, nbad);
+
+    long deadline = now_ms() + UPSTREAM_TIMEOUT;
+    long next_start = 0;
+
+    while (sockfd == -1 && (next < ncand || npending > 0)) {
+        long now = now_ms();
+        if (now >= deadline) break;
+
+        /* start another attempt when the stagger is up or nothing is in flight */
+        if (next < ncand && (npending == 0 || now >= next_start)) {
+            int fd = attempt_start(cand[next], UPSTREAM_FASTOPEN && ncand == 1);
+            if (fd == -1) {
+                addr_mark(cand[next], 1);
+                next_start = 0;
+            } else {
+                pfd[npending].fd = fd;
+                pfd[npending].events = POLLOUT;
+                started[npending] = now;
+                pending[npending++] = cand[next];
+                next_start = now + UPSTREAM_STAGGER;
+            }
+            next++;
+            continue;
+        }
+
+        long timeout = deadline - now;
+        if (next < ncand && next_start - now < timeout)
+            timeout = next_start - now;
+
+        int rc = coro_poll(pfd, npending, (int) timeout);
+        if (rc == -1) {
+            if (errno == EINTR) continue;
+            perror("upstream: poll");
+            break;
+        }
+
+        for (i = 0; i < npending; ++i) {
+            if (pfd[i].revents == 0) continue;
+
+            int so_err = 0;
+            socklen_t len = sizeof(so_err);
+            getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &so_err, &len);
+
+            if (so_err == 0 && sockfd == -1) {
+                sockfd = pfd[i].fd;
+                won_at = started[i];
+                addr_mark(pending[i], 0);
+            } else {
+                if (so_err != 0)
+                    addr_mark(pending[i], 1);
+                close(pfd[i].fd);
+            }
+
+            /* drop it from the set, the last one takes its place */
+            pfd[i] = pfd[npending - 1];
+            pending[i] = pending[npending - 1];
+            started[i] = started[npending - 1];
+            npending--;
+            i--;
+
+            /* a failure frees the way for the next address right now */
+            next_start = 0;
+        }
+    }
+
+    /*
+     * losers of the race are closed. Ones still connecting at the deadline
+     * count as failed, and so do ones that had a head start on the winner
+     * and still lost, or every request would wait out the stagger on them.
+     */
+    for (i = 0; i < npending; ++i) {
+        if (sockfd == -1 || started[i] < won_at) addr_mark(pending[i], 1);
+        close(pfd[i].fd);
+    }
+
+    if (sockfd == -1) {
+        fprintf(stderr, "upstream: failed to connect to %s\n", host);
+        freeaddrinfo(servlist);
+        return -1;
+    }
+
+    /*
+     * threads talk to remote servers with blocking I/O, coroutines need
+     * EAGAIN to know when to park
+     */
+    if (!coro_active()) {
+        int flags = fcntl(sockfd, F_GETFL, 0);
+        fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    int yes = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1)
+        perror("setsockopt TCP_NODELAY");
+
+    freeaddrinfo(servlist);
+    return sockfd;
+}
+
+/*
+ * Static functions
+ */
+
+static int attempt_start(struct addrinfo *ai, int fastopen)
+/* nonblocking connect, returns the socket or -1 if it failed right away */
+{
+    int fd;
+    char s[INET6_ADDRSTRLEN];
+
+    inet_ntop(ai->ai_family, get_in_addr(ai->ai_addr), s, sizeof(s));
+    fprintf(stderr, "upstream: trying %s\n", s);
+
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol)) == -1) {
+        perror("upstream: socket");
+        return -1;
+    }
+
+#ifdef TCP_FASTOPEN_CONNECT
+    int yes = 1;
+    if (fastopen && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(int)) == -1)
+        perror("setsockopt TCP_FASTOPEN_CONNECT");
+#endif
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        perror("upstream: connect");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int addr_is_bad(struct addrinfo *ai)
+{
+    int bad = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&bad_mutex);
+    for (int i = 0; i < BAD_SLOTS; ++i) {
+        if (bad_addrs[i].until > now &&
+            bad_addrs[i].addrlen == ai->ai_addrlen &&
+            !memcmp(&bad_addrs[i].addr, ai->ai_addr, ai->ai_addrlen)) {
+            bad = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bad_mutex);
+
+    return bad;
+}
+
+static void addr_mark(struct addrinfo *ai, int bad)
+/* remember (or forget) that connecting to this address fails */
+{
+    time_t now = time(NULL);
+    int slot = -1, oldest = 0;
+
+    pthread_mutex_lock(&bad_mutex);
+    for (int i = 0; i < BAD_SLOTS; ++i) {
+        if (bad_addrs[i].addrlen == ai->ai_addrlen &&
+            !memcmp(&bad_addrs[i].addr, ai->ai_addr, ai->ai_addrlen)) {
+            slot = i;
+            break;
+        }
+        if (bad_addrs[i].until < bad_addrs[oldest].until)
+            oldest = i;
+    }
+
+    if (bad) {
+        if (slot == -1) {
+            slot = oldest;  // expired entries have the smallest until
+            memcpy(&bad_addrs[slot].addr, ai->ai_addr, ai->ai_addrlen);
+            bad_addrs[slot].addrlen = ai->ai_addrlen;
+        }
+        bad_addrs[slot].until = now + BAD_TTL;
+    } else if (slot != -1) {
+        bad_addrs[slot].until = 0;
+    }
+    pthread_mutex_unlock(&bad_mutex);
+}
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
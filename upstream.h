@@ -0,0 +1,18 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+/*
+ * connect to a remote server the way RFC 8305 (Happy Eyeballs v2) does:
+ * all addresses of host are tried, alternating between IPv6 and IPv4,
+ * each attempt started UPSTREAM_STAGGER ms after the previous one unless
+ * that one has already failed, and the first to complete wins.
+ *
+ * Addresses that recently failed are remembered and skipped as long as
+ * there is anything else to try.
+ *
+ * returns a connected socket with TCP_NODELAY set, or -1. The socket is
+ * blocking unless we are running in a coroutine.
+ */
+int upstream_connect(const char *host, const char *port);
+
+#endif
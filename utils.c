@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
@@ -5,6 +6,10 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "utils.h"
 
 void *get_in_addr(struct sockaddr *sa)
 {
@@ -29,3 +34,117 @@ void set_nonblock(int fd)
         exit(EXIT_FAILURE);
     }
 }
+
+int send_fd(int sock, int fd)
+{
+    char byte = 0;  // something has to be sent for the descriptor to ride along
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(ctl, 0, sizeof(ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(sock, &msg, 0) != 1) {
+        perror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+int recv_fd(int sock)
+{
+    char byte;
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        perror("recvmsg");
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+static const char *header_find(const char *headers, const char *name)
+/* start of the first line holding header name, or NULL */
+{
+    size_t namelen = strlen(name);
+    const char *line = headers;
+
+    while (line != NULL && *line != '\0') {
+        if (!strncasecmp(line, name, namelen) && line[namelen] == ':')
+            return line;
+        line = strchr(line, '\n');
+        if (line != NULL) line++;
+    }
+
+    return NULL;
+}
+
+int header_get(const char *headers, const char *name, char *val, size_t len)
+{
+    const char *line = header_find(headers, name);
+    size_t n = 0;
+
+    if (line == NULL) return 0;
+
+    line += strlen(name) + 1;
+    while (*line == ' ' || *line == '\t') line++;
+
+    while (line[n] != '\0' && line[n] != '\r' && line[n] != '\n' && n + 1 < len)
+        n++;
+    while (n > 0 && (line[n - 1] == ' ' || line[n - 1] == '\t'))
+        n--;
+
+    memcpy(val, line, n);
+    val[n] = '\0';
+    return 1;
+}
+
+void header_strip(char *headers, const char *name)
+{
+    char *line, *end;
+
+    while ((line = (char *) header_find(headers, name)) != NULL) {
+        end = strchr(line, '\n');
+        end = end != NULL ? end + 1 : line + strlen(line);
+        memmove(line, end, strlen(end) + 1);
+    }
+}
+
+time_t http_date(const char *s)
+{
+    struct tm tm;
+    char *end;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL) return -1;
+
+    return timegm(&tm);
+}
@@ -1,4 +1,28 @@
+#ifndef UTILS_H
+#define UTILS_H
+
 #include <sys/socket.h>
+#include <time.h>
 
 void *get_in_addr(struct sockaddr *sa);
 void set_nonblock(int fd);
+
+// pass fd over the Unix socket sock with SCM_RIGHTS, 0 or -1
+int  send_fd(int sock, int fd);
+// the descriptor send_fd passed over sock, close-on-exec, or -1
+int  recv_fd(int sock);
+
+/*
+ * helpers for a block of CRLF-terminated "Name: value" header lines,
+ * names are matched case-insensitively
+ */
+
+// copy the value of the first header called name into val, 1 if found
+int    header_get(const char *headers, const char *name, char *val, size_t len);
+// remove every header called name, in place
+void   header_strip(char *headers, const char *name);
+
+// parse an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT", -1 if invalid
+time_t http_date(const char *s);
+
+#endif